@@ -1,45 +1,543 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/buffer_head.h>
+#include <linux/bitops.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
 #include "pintfs.h"
 #define	DEBUG	1
 
 /*
-	pintfs_empty_block - find next usable block number
+	pintfs_find_free_bit - next-fit search for a clear bit in [first, count)
+	Start at hint and wrap around to first. Return -1 if all bits are set.
 */
-int pintfs_empty_block(struct super_block *sb)
+int pintfs_find_free_bit(void *bitmap, unsigned int first,
+		unsigned int count, unsigned int hint)
 {
-	struct pintfs_sb_info *sbi;
-	struct pintfs_super_block *psb;
-	struct buffer_head *bh;
-	int block_bitmap_bno;
-	char block_bitmap[PINTFS_BLOCK_BITMAP_SIZE];
-	int result = -1, i;
-	
-	if(DEBUG)
-		printk("pintfs - pintfs_empty_block\n");
-
-	sbi = PINTFS_SB(sb);
-	if(!sbi)
-		return result;
-
-	psb = sbi->s_es;
-	block_bitmap_bno = psb->block_bitmap_block;
-	bh = sb_bread(sb, block_bitmap_bno);
-	if(!bh)
-		return result;
-
-	memcpy(block_bitmap, bh->b_data, PINTFS_BLOCK_BITMAP_SIZE);	
-	for(i=PINTFS_FIRST_DATA_BLOCK; i<PINTFS_BLOCK_BITMAP_SIZE; i++){
-		if(block_bitmap[i] == 0){
-			bh->b_data[i] = 1;
-			mark_buffer_dirty(bh);
-			sync_dirty_buffer(bh);
-			result = i;
+	unsigned long bit;
+
+	if(hint < first || hint >= count)
+		hint = first;
+
+	bit = find_next_zero_bit_le(bitmap, count, hint);
+	if(bit < count)
+		return bit;
+
+	bit = find_next_zero_bit_le(bitmap, hint, first);
+	if(bit < hint)
+		return bit;
+
+	return -1;
+}
+
+/*
+	pintfs_get_group_desc - descriptor of 'group' in the pinned descriptor blocks
+*/
+struct pintfs_group_desc *pintfs_get_group_desc(struct super_block *sb,
+		unsigned int group, struct buffer_head **bh)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+
+	if(group >= sbi->s_groups_count){
+		printk("pintfs - get_group_desc: bad group %u\n", group);
+		return NULL;
+	}
+
+	*bh = sbi->s_group_desc[group / PINTFS_DESC_PER_BLOCK];
+	desc = (struct pintfs_group_desc *)(*bh)->b_data;
+	return desc + group % PINTFS_DESC_PER_BLOCK;
+}
+
+/*
+	pintfs_pin_bitmap - bitmap buffer kept in *slot, read on first use
+	It stays pinned until put_super, so callers never brelse it.
+*/
+static struct buffer_head *pintfs_pin_bitmap(struct super_block *sb,
+		struct buffer_head **slot, unsigned int block)
+{
+	struct buffer_head *bh, *old;
+
+	bh = smp_load_acquire(slot);
+	if(bh)
+		return bh;
+
+	bh = sb_bread(sb, block);
+	if(!bh){
+		printk("pintfs - unable to read bitmap %u\n", block);
+		return NULL;
+	}
+	// another task read it first, keep theirs
+	old = cmpxchg(slot, NULL, bh);
+	if(old){
+		brelse(bh);
+		return old;
+	}
+	return bh;
+}
+
+/*
+	pintfs_read_block_bitmap - pinned block bitmap of 'group'
+*/
+static struct buffer_head *pintfs_read_block_bitmap(struct super_block *sb,
+		unsigned int group, struct pintfs_group_desc *desc)
+{
+	return pintfs_pin_bitmap(sb, &PINTFS_SB(sb)->s_group_info[group].gi_block_bh,
+			desc->bg_block_bitmap);
+}
+
+/*
+	pintfs_read_inode_bitmap - pinned inode bitmap of 'group'
+*/
+struct buffer_head *pintfs_read_inode_bitmap(struct super_block *sb, unsigned int group,
+		struct pintfs_group_desc *desc)
+{
+	return pintfs_pin_bitmap(sb, &PINTFS_SB(sb)->s_group_info[group].gi_inode_bh,
+			desc->bg_inode_bitmap);
+}
+
+/*
+	pintfs_release_bitmaps - unpin every bitmap read since mount
+*/
+void pintfs_release_bitmaps(struct super_block *sb)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	unsigned int i;
+
+	for(i = 0; i < sbi->s_groups_count; i++){
+		brelse(sbi->s_group_info[i].gi_block_bh);
+		brelse(sbi->s_group_info[i].gi_inode_bh);
+	}
+}
+
+/*
+	pintfs_find_goal - disk block where file block 'iblock' would best go
+	Right after the block allocated last if iblock follows it, else next
+	to 'near' (a mapped neighbour found by the caller, 0 if none), else
+	where the inode was told to start (see pintfs_new_inode).
+*/
+unsigned int pintfs_find_goal(struct inode *inode, unsigned long iblock, unsigned int near)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+
+	if(pii->i_next_pblk && iblock == pii->i_next_lblk)
+		return pii->i_next_pblk;
+	if(near)
+		return near;
+	return pii->i_next_pblk;
+}
+
+/*
+   Free extent tree - every group keeps its free space as an rbtree of
+   runs keyed by start (group relative). It is built from the bitmap the
+   first time the group is used and then kept in step with it, so a
+   contiguous run near a goal is found without scanning bits.
+   The tree is under the group lock; the bitmap stays the on-disk truth.
+*/
+struct pintfs_free_extent {
+	struct rb_node	fe_node;
+	unsigned int	fe_start;
+	unsigned int	fe_len;
+};
+
+#define PINTFS_FE_SCAN	8	/* extents looked at past the goal for a whole fit */
+
+static inline struct pintfs_free_extent *pintfs_fe(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct pintfs_free_extent, fe_node) : NULL;
+}
+
+static inline struct pintfs_free_extent *pintfs_fe_next(struct pintfs_free_extent *fe)
+{
+	return pintfs_fe(rb_next(&fe->fe_node));
+}
+
+/* the extent holding 'bit', else the first one after it */
+static struct pintfs_free_extent *pintfs_fe_lookup(struct rb_root *root, unsigned int bit)
+{
+	struct rb_node *n = root->rb_node;
+	struct pintfs_free_extent *fe, *after = NULL;
+
+	while(n){
+		fe = pintfs_fe(n);
+		if(bit < fe->fe_start){
+			after = fe;
+			n = n->rb_left;
+		}
+		else if(bit >= fe->fe_start + fe->fe_len)
+			n = n->rb_right;
+		else
+			return fe;
+	}
+	return after;
+}
+
+static void pintfs_fe_insert(struct rb_root *root, struct pintfs_free_extent *new)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+
+	while(*p){
+		parent = *p;
+		if(new->fe_start < pintfs_fe(parent)->fe_start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->fe_node, parent, p);
+	rb_insert_color(&new->fe_node, root);
+}
+
+/*
+	pintfs_fe_take - carve up to *count blocks near 'goal' out of the tree
+	Return the first bit and set *count to what was taken, -1 if empty.
+	*spare is used (and cleared) when an extent has to be split.
+*/
+static int pintfs_fe_take(struct rb_root *root, unsigned int goal, unsigned int *count,
+		struct pintfs_free_extent **spare)
+{
+	struct pintfs_free_extent *fe, *f, *tail;
+	unsigned int start, end, len;
+	int n;
+
+	fe = pintfs_fe_lookup(root, goal);
+	if(!fe)
+		fe = pintfs_fe(rb_first(root));
+	if(!fe)
+		return -1;
+
+	if(goal >= fe->fe_start && goal < fe->fe_start + fe->fe_len)
+		start = goal;
+	else{
+		// goal is taken: prefer a nearby run the whole request fits in
+		for(f = fe, n = 0; f && n < PINTFS_FE_SCAN; f = pintfs_fe_next(f), n++)
+			if(f->fe_len >= *count){
+				fe = f;
+				break;
+			}
+		start = fe->fe_start;
+	}
+	end = fe->fe_start + fe->fe_len;
+	len = min(*count, end - start);
+
+	if(start == fe->fe_start){
+		fe->fe_start += len;
+		fe->fe_len -= len;
+		if(!fe->fe_len){
+			rb_erase(&fe->fe_node, root);
+			kfree(fe);
+		}
+	}
+	else if(start + len == end)
+		fe->fe_len -= len;
+	else{
+		tail = *spare;
+		*spare = NULL;
+		tail->fe_start = start + len;
+		tail->fe_len = end - tail->fe_start;
+		fe->fe_len = start - fe->fe_start;
+		pintfs_fe_insert(root, tail);
+	}
+
+	*count = len;
+	return start;
+}
+
+/*
+	pintfs_fe_give - put [start, start + len) back, merging with its neighbours
+*/
+static void pintfs_fe_give(struct rb_root *root, unsigned int start, unsigned int len,
+		struct pintfs_free_extent **spare)
+{
+	struct pintfs_free_extent *next, *prev, *new;
+	struct rb_node *n;
+
+	next = pintfs_fe_lookup(root, start);
+	n = next ? rb_prev(&next->fe_node) : rb_last(root);
+	prev = pintfs_fe(n);
+
+	if(prev && prev->fe_start + prev->fe_len == start){
+		prev->fe_len += len;
+		if(next && next->fe_start == start + len){
+			prev->fe_len += next->fe_len;
+			rb_erase(&next->fe_node, root);
+			kfree(next);
+		}
+		return;
+	}
+	if(next && next->fe_start == start + len){
+		next->fe_start = start;
+		next->fe_len += len;
+		return;
+	}
+
+	new = *spare;
+	*spare = NULL;
+	new->fe_start = start;
+	new->fe_len = len;
+	pintfs_fe_insert(root, new);
+}
+
+/*
+	pintfs_load_group - build the free extent tree of 'group' from its bitmap
+	Runs once per group under s_group_load_mutex. Nobody changes the
+	bitmap meanwhile, since every allocation and free loads the group first.
+*/
+static int pintfs_load_group(struct super_block *sb, unsigned int group,
+		struct buffer_head *bh)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_info *gi = &sbi->s_group_info[group];
+	struct pintfs_free_extent *fe;
+	struct rb_root root = RB_ROOT;
+	unsigned int nbits = pintfs_group_blocks(sb, group);
+	unsigned long start, end = 0;
+
+	if(smp_load_acquire(&gi->gi_loaded))
+		return 0;
+
+	mutex_lock(&sbi->s_group_load_mutex);
+	if(gi->gi_loaded)
+		goto out;
+
+	for(;;){
+		start = find_next_zero_bit_le(bh->b_data, nbits, end);
+		if(start >= nbits)
 			break;
+		end = find_next_bit_le(bh->b_data, nbits, start);
+		fe = kmalloc(sizeof(*fe), GFP_NOFS);
+		if(!fe){
+			pintfs_release_free_extents(&root);
+			mutex_unlock(&sbi->s_group_load_mutex);
+			return -ENOMEM;
 		}
+		fe->fe_start = start;
+		fe->fe_len = end - start;
+		pintfs_fe_insert(&root, fe);
 	}
+
+	spin_lock(pintfs_group_lock(sbi, group));
+	gi->gi_free = root;
+	spin_unlock(pintfs_group_lock(sbi, group));
+	smp_store_release(&gi->gi_loaded, true);
+out:
+	mutex_unlock(&sbi->s_group_load_mutex);
+	return 0;
+}
+
+/*
+	pintfs_release_free_extents - drop a whole free extent tree
+*/
+void pintfs_release_free_extents(struct rb_root *root)
+{
+	struct pintfs_free_extent *fe, *next;
+
+	rbtree_postorder_for_each_entry_safe(fe, next, root, fe_node)
+		kfree(fe);
+	*root = RB_ROOT;
+}
+
+/*
+	pintfs_unreserved_blocks - free blocks not promised to delayed buffers
+	Slack is kept for the map blocks the delayed data will need. sum reads
+	the exact counters, for when the disk is nearly full.
+*/
+static s64 pintfs_unreserved_blocks(struct pintfs_sb_info *sbi, bool sum)
+{
+	s64 free, dirty;
+
+	if(sum){
+		free = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+		dirty = percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter);
+	}
+	else{
+		free = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+		dirty = percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+	}
+	return free - dirty - dirty / PINTFS_ADDR_PER_BLOCK - 2;
+}
+
+/*
+	pintfs_new_blocks - alloc up to *count contiguous blocks near 'goal'
+	Search the group of 'goal' from goal on, then the following groups.
+	Without a goal start at the group of the inode. Return the first
+	block and set *count to the length of the run, -1 if the disk is full.
+	Blocks reserved for delayed buffers are off limits unless the inode
+	is allocating for them (i_alloc_reserved).
+*/
+int pintfs_new_blocks(struct inode *inode, unsigned int goal, unsigned int *count)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct pintfs_free_extent *spare;
+	struct buffer_head *bh, *gdbh;
+	unsigned int start, group, i, k, len, hint = 0;
+	int bit;
 	
-	brelse(bh);
-	return result;
+	s64 avail;
+
+	if(DEBUG)
+		printk("pintfs - pintfs_new_blocks goal=%u count=%u\n", goal, *count);
+
+	if(!PINTFS_I(inode)->i_alloc_reserved){
+		avail = pintfs_unreserved_blocks(sbi, false);
+		if(avail < *count + PINTFS_DELAY_MAX_RUN)
+			avail = pintfs_unreserved_blocks(sbi, true);
+		if(avail <= 0)
+			return -1;
+		if(*count > avail)
+			*count = avail;
+	}
+
+	if(goal >= sbi->s_es->first_data_block && goal < sbi->s_es->blocks_count){
+		start = (goal - sbi->s_es->first_data_block) / sbi->s_blocks_per_group;
+		hint = (goal - sbi->s_es->first_data_block) % sbi->s_blocks_per_group;
+	}
+	else
+		start = pintfs_ino_group(sb, inode->i_ino);
+
+	for(i = 0; i < sbi->s_groups_count; i++, hint = 0){
+		group = (start + i) % sbi->s_groups_count;
+		desc = pintfs_get_group_desc(sb, group, &gdbh);
+		if(!desc || !desc->bg_free_blocks_count)
+			continue;
+
+		bh = pintfs_read_block_bitmap(sb, group, desc);
+		if(!bh)
+			return -1;
+		if(pintfs_load_group(sb, group, bh))
+			return -1;
+		spare = kmalloc(sizeof(*spare), GFP_NOFS);
+		if(!spare)
+			return -1;
+
+		len = *count;
+		spin_lock(pintfs_group_lock(sbi, group));
+		bit = pintfs_fe_take(&sbi->s_group_info[group].gi_free, hint, &len, &spare);
+		if(bit >= 0){
+			for(k = 0; k < len; k++)
+				__set_bit_le(bit + k, bh->b_data);
+			desc->bg_free_blocks_count -= len;
+		}
+		spin_unlock(pintfs_group_lock(sbi, group));
+		kfree(spare);
+
+		if(bit >= 0){
+			percpu_counter_sub(&sbi->s_freeblocks_counter, len);
+			pintfs_dirty_buffer(sb, bh);
+			pintfs_dirty_buffer(sb, gdbh);
+			*count = len;
+			return pintfs_group_first_block(sb, group) + bit;
+		}
+	}
+	return -1;
+}
+
+/*
+	pintfs_empty_block - alloc a single block near 'goal'
+*/
+int pintfs_empty_block(struct inode *inode, unsigned int goal)
+{
+	unsigned int count = 1;
+
+	return pintfs_new_blocks(inode, goal, &count);
+}
+
+/*
+	pintfs_free_blocks - give [block_no, block_no + count) back to the bitmaps
+*/
+void pintfs_free_blocks(struct super_block *sb, unsigned int block_no, unsigned int count)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct pintfs_free_extent *spare;
+	struct buffer_head *bh, *gdbh;
+	unsigned int group, bit, len, i;
+	bool ok;
+
+	if(block_no < sbi->s_es->first_data_block || block_no + count < block_no ||
+			block_no + count > sbi->s_es->blocks_count)
+		goto bad;
+
+	// a run may cross into the next group
+	for(; count; block_no += len, count -= len){
+		group = (block_no - sbi->s_es->first_data_block) / sbi->s_blocks_per_group;
+		bit = (block_no - sbi->s_es->first_data_block) % sbi->s_blocks_per_group;
+		len = min(count, pintfs_group_blocks(sb, group) - bit);
+		desc = pintfs_get_group_desc(sb, group, &gdbh);
+		if(!desc)
+			goto bad;
+		// never free the group metadata
+		if(block_no < desc->bg_inode_table + sbi->s_itb_per_group)
+			goto bad;
+
+		bh = pintfs_read_block_bitmap(sb, group, desc);
+		if(!bh)
+			return;
+		spare = kmalloc(sizeof(*spare), GFP_NOFS | __GFP_NOFAIL);
+		if(pintfs_load_group(sb, group, bh)){
+			// no tree to keep in step, the blocks stay used
+			kfree(spare);
+			return;
+		}
+
+		spin_lock(pintfs_group_lock(sbi, group));
+		// refuse a run that is already (partly) free
+		ok = find_next_zero_bit_le(bh->b_data, bit + len, bit) >= bit + len;
+		if(ok){
+			for(i = 0; i < len; i++)
+				__clear_bit_le(bit + i, bh->b_data);
+			pintfs_fe_give(&sbi->s_group_info[group].gi_free, bit, len, &spare);
+			desc->bg_free_blocks_count += len;
+		}
+		spin_unlock(pintfs_group_lock(sbi, group));
+		kfree(spare);
+
+		if(ok){
+			percpu_counter_add(&sbi->s_freeblocks_counter, len);
+			pintfs_dirty_buffer(sb, bh);
+			pintfs_dirty_buffer(sb, gdbh);
+		}
+		else
+			printk("pintfs - free_blocks: blocks %u+%u already free\n", block_no, len);
+	}
+	return;
+
+bad:
+	printk("pintfs - free_blocks: bad blocks %u+%u\n", block_no, count);
+}
+
+/*
+	pintfs_free_block - give one block back
+*/
+void pintfs_free_block(struct super_block *sb, unsigned int block_no)
+{
+	pintfs_free_blocks(sb, block_no, 1);
+}
+
+/*
+	pintfs_reserve_blocks - hold back count blocks for delayed buffers
+	Some slack is kept for the map blocks the data will need.
+	Return 0 or -ENOSPC.
+*/
+int pintfs_reserve_blocks(struct super_block *sb, unsigned int count)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	s64 need = count + count / PINTFS_ADDR_PER_BLOCK;
+
+	if(pintfs_unreserved_blocks(sbi, false) < need + PINTFS_DELAY_MAX_RUN){
+		// close to full, the percpu drift matters now
+		if(pintfs_unreserved_blocks(sbi, true) < need)
+			return -ENOSPC;
+	}
+	percpu_counter_add(&sbi->s_dirtyblocks_counter, count);
+	return 0;
+}
+
+/*
+	pintfs_release_blocks - drop reservations taken by pintfs_reserve_blocks
+*/
+void pintfs_release_blocks(struct super_block *sb, unsigned int count)
+{
+	percpu_counter_sub(&PINTFS_SB(sb)->s_dirtyblocks_counter, count);
 }
@@ -3,86 +3,653 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include "pintfs.h"
 
 #define DEBUG 1
 
+#define PINTFS_DIR_BLOCK(bh)	((struct pintfs_dir_block *)(bh)->b_data)
+
+/*
+   pintfs_name_hash - FNV-1a hash of a name
+   It picks the leaf block on disk, so it must never change.
+*/
+static unsigned int pintfs_name_hash(const char *name, unsigned int len)
+{
+	unsigned int hash = 2166136261U;
+
+	while(len--){
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+   pintfs_dx_slot - index slot of a hash: its top dx_depth bits
+*/
+static inline unsigned int pintfs_dx_slot(struct pintfs_dx_root *root, unsigned int hash)
+{
+	return root->dx_depth ? hash >> (32 - root->dx_depth) : 0;
+}
+
+/*
+   pintfs_dir_tag - slot fingerprint of a hash
+   Low bits, since the top bits are what all names of one leaf share. Never 0.
+*/
+static inline unsigned char pintfs_dir_tag(unsigned int hash)
+{
+	return (hash & 0xff) ? (hash & 0xff) : 1;
+}
+
+/*
+   pintfs_dir_next_tag - next slot at or after 'from' whose tag is 'tag'
+   Compare sizeof(long) tags per step: a word has a candidate if one of its
+   bytes XORed with the tag is zero. Candidates are checked byte by byte.
+   Return -1 if there is none.
+*/
+static int pintfs_dir_next_tag(struct pintfs_dir_block *db, unsigned char tag, int from)
+{
+	const unsigned long *words = (const unsigned long *)db->db_tag;
+	const unsigned long pattern = REPEAT_BYTE(tag);
+	unsigned long x;
+	int w, i, end;
+
+	for(w = from / sizeof(long); w < PINTFS_DIR_TAG_BYTES / sizeof(long); w++){
+		x = words[w] ^ pattern;
+		if(!((x - REPEAT_BYTE(0x01)) & ~x & REPEAT_BYTE(0x80)))
+			continue;
+
+		i = max_t(int, from, w * sizeof(long));
+		end = min_t(int, (w + 1) * sizeof(long), PINTFS_DIR_SLOTS);
+		for(; i < end; i++)
+			if(db->db_tag[i] == tag)
+				return i;
+	}
+	return -1;
+}
+
+static inline unsigned int pintfs_dir_blocks(struct inode *dir)
+{
+	return dir->i_size >> PINTFS_BLOCK_BITS;
+}
+
+/*
+   Free slot map - for each directory block, the lowest slot that may be
+   free (PINTFS_DIR_SLOTS: block is full). It lives only in memory: a
+   missing entry reads as 0, which is always safe.
+*/
+static unsigned int pintfs_free_hint(struct inode *dir, unsigned int lblk)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(dir);
+
+	return lblk < pii->i_dir_nfree ? pii->i_dir_free[lblk] : 0;
+}
+
+static void pintfs_set_free_hint(struct inode *dir, unsigned int lblk, unsigned int slot)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(dir);
+	unsigned char *map;
+	unsigned int n;
+
+	if(lblk >= pii->i_dir_nfree){
+		n = max(lblk + 1, pintfs_dir_blocks(dir));
+		map = krealloc(pii->i_dir_free, n, GFP_NOFS);
+		if(!map)
+			return;
+		memset(map + pii->i_dir_nfree, 0, n - pii->i_dir_nfree);
+		pii->i_dir_free = map;
+		pii->i_dir_nfree = n;
+	}
+	pii->i_dir_free[lblk] = slot;
+}
+
+/*
+   pintfs_dir_bread - read directory block 'lblk', alloc a zeroed one if create
+*/
+struct buffer_head *pintfs_dir_bread(struct inode *dir, unsigned int lblk, int create)
+{
+	struct buffer_head *bh;
+	unsigned int bno;
+	bool new;
+	int ret;
+
+	ret = pintfs_get_blocks(dir, lblk, 1, create, &bno, &new);
+	if(ret < 0)
+		return ERR_PTR(ret);
+	if(!bno){
+		printk("pintfs - dir %ld has a hole at block %u\n", dir->i_ino, lblk);
+		return ERR_PTR(-EIO);
+	}
+
+	if(!new){
+		bh = sb_bread(dir->i_sb, bno);
+		return bh ? bh : ERR_PTR(-EIO);
+	}
+
+	bh = sb_getblk(dir->i_sb, bno);
+	if(!bh)
+		return ERR_PTR(-ENOMEM);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PINTFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	pintfs_dirty_buffer(dir->i_sb, bh);
+	return bh;
+}
+
+/*
+   pintfs_dir_readahead - start reading dir blocks [lblk, end), at most
+   PINTFS_META_RA of them, for a walk over every block
+*/
+static void pintfs_dir_readahead(struct inode *dir, unsigned int lblk, unsigned int end)
+{
+	unsigned int bno, i;
+	bool new;
+	int ret;
+
+	end = min(end, lblk + PINTFS_META_RA);
+	while(lblk < end){
+		ret = pintfs_get_blocks(dir, lblk, end - lblk, 0, &bno, &new);
+		if(ret <= 0)
+			return;
+		for(i = 0; bno && i < ret; i++){
+			if(!pintfs_block_cached(dir->i_sb, bno + i))
+				sb_breadahead(dir->i_sb, bno + i);
+		}
+		lblk += ret;
+	}
+}
+
+/*
+   pintfs_itable_readahead - start reading the inode table blocks of the
+   entries in db from slot 'from' on. readdir is mostly followed by a stat
+   of every name, and each iget would otherwise wait on its own block.
+*/
+static void pintfs_itable_readahead(struct inode *dir, struct pintfs_dir_block *db, int from)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned int block, last = 0;
+	int k;
+
+	for(k = from; k < PINTFS_DIR_SLOTS; k++){
+		if(!db->db_tag[k])
+			continue;
+		block = pintfs_inode_block(sb, db->db_entry[k].inode_number);
+		// entries made together sit in the same table block
+		if(!block || block == last)
+			continue;
+		last = block;
+		if(!pintfs_block_cached(sb, block))
+			sb_breadahead(sb, block);
+	}
+}
+
+/*
+   pintfs_dir_leaf - read the block that holds (or would hold) 'name'
+   A linear directory is just block 0. For an indexed one, *root_bh gets
+   the index block (block 0) and the hash picks the leaf. *lblkp is the
+   block number of the leaf in the directory.
+*/
+static struct buffer_head *pintfs_dir_leaf(struct inode *dir, const struct qstr *name,
+		struct buffer_head **root_bh, unsigned int *lblkp)
+{
+	struct pintfs_dx_root *root;
+	struct buffer_head *bh, *leaf;
+	unsigned int lblk;
+
+	*root_bh = NULL;
+	*lblkp = 0;
+	bh = pintfs_dir_bread(dir, 0, 0);
+	if(IS_ERR(bh) || !(PINTFS_I(dir)->i_flags & PINTFS_INDEX_FL))
+		return bh;
+
+	root = (struct pintfs_dx_root *)bh->b_data;
+	if(root->dx_magic != PINTFS_DX_MAGIC || root->dx_depth > PINTFS_DX_MAX_DEPTH)
+		goto corrupt;
+	lblk = root->dx_slot[pintfs_dx_slot(root, pintfs_name_hash(name->name, name->len))];
+	if(!lblk || lblk >= pintfs_dir_blocks(dir))
+		goto corrupt;
+
+	leaf = pintfs_dir_bread(dir, lblk, 0);
+	if(IS_ERR(leaf))
+		brelse(bh);
+	else{
+		*root_bh = bh;
+		*lblkp = lblk;
+	}
+	return leaf;
+
+corrupt:
+	printk("pintfs - bad directory index in inode %ld\n", dir->i_ino);
+	brelse(bh);
+	return ERR_PTR(-EIO);
+}
+
+static bool pintfs_match(const struct qstr *name, struct pintfs_dir_entry *pde)
+{
+	return pde->name_len == name->len && !memcmp(pde->name, name->name, name->len);
+}
+
+/*
+   pintfs_find_entry - find 'name' in dir
+   Return the entry inside *res_bh (caller brelse), NULL if there is none.
+   *res_lblk (if not NULL) gets the directory block holding it.
+*/
+struct pintfs_dir_entry *pintfs_find_entry(struct inode *dir, const struct qstr *name,
+		struct buffer_head **res_bh, unsigned int *res_lblk)
+{
+	struct buffer_head *bh, *root_bh;
+	struct pintfs_dir_block *db;
+	unsigned int lblk;
+	unsigned char tag;
+	int i;
+
+	bh = pintfs_dir_leaf(dir, name, &root_bh, &lblk);
+	brelse(root_bh);
+	if(IS_ERR(bh))
+		return ERR_CAST(bh);
+
+	db = PINTFS_DIR_BLOCK(bh);
+	tag = pintfs_dir_tag(pintfs_name_hash(name->name, name->len));
+	for(i = pintfs_dir_next_tag(db, tag, 0); i >= 0; i = pintfs_dir_next_tag(db, tag, i + 1)){
+		if(pintfs_match(name, &db->db_entry[i])){
+			*res_bh = bh;
+			if(res_lblk)
+				*res_lblk = lblk;
+			return &db->db_entry[i];
+		}
+	}
+
+	brelse(bh);
+	return NULL;
+}
+
+/*
+   pintfs_dx_convert - turn the full linear directory into an indexed one
+   Block 0 moves to block 1 and becomes the index with one slot.
+*/
+static int pintfs_dx_convert(struct inode *dir, struct buffer_head *bh)
+{
+	struct pintfs_dx_root *root;
+	struct buffer_head *leaf;
+
+	if(DEBUG)
+		printk("pintfs - dx_convert dir=%ld\n", dir->i_ino);
+
+	leaf = pintfs_dir_bread(dir, 1, 1);
+	if(IS_ERR(leaf))
+		return PTR_ERR(leaf);
+	memcpy(leaf->b_data, bh->b_data, PINTFS_BLOCK_SIZE);
+	pintfs_dirty_buffer(dir->i_sb, leaf);
+	brelse(leaf);
+	pintfs_set_free_hint(dir, 1, pintfs_free_hint(dir, 0));
+
+	memset(bh->b_data, 0, PINTFS_BLOCK_SIZE);
+	root = (struct pintfs_dx_root *)bh->b_data;
+	root->dx_magic = PINTFS_DX_MAGIC;
+	root->dx_depth = 0;
+	root->dx_slot[0] = 1;
+	root->dx_leaf_depth[0] = 0;
+	pintfs_dirty_buffer(dir->i_sb, bh);
+
+	dir->i_size = 2 * PINTFS_BLOCK_SIZE;
+	PINTFS_I(dir)->i_flags |= PINTFS_INDEX_FL;
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+   pintfs_dx_split - split the full leaf for 'hash' in two (extendible hashing)
+   The leaf's slots are halved between it and a new block, doubling the
+   index first if the leaf already uses every hash bit of it. A moved
+   entry keeps its slot number, which is part of its readdir cookie.
+*/
+static int pintfs_dx_split(struct inode *dir, struct buffer_head *root_bh,
+		struct buffer_head *leaf_bh, unsigned int leaf_lblk, unsigned int hash)
+{
+	struct pintfs_dx_root *root = (struct pintfs_dx_root *)root_bh->b_data;
+	struct pintfs_dir_block *db = PINTFS_DIR_BLOCK(leaf_bh), *ndb;
+	struct pintfs_dir_entry *pde;
+	struct buffer_head *new_bh;
+	unsigned int slot, ld, span, first, new_lblk, h;
+	int i;
+
+	if(DEBUG)
+		printk("pintfs - dx_split dir=%ld\n", dir->i_ino);
+
+	slot = pintfs_dx_slot(root, hash);
+	ld = root->dx_leaf_depth[slot];
+	if(ld == root->dx_depth){
+		if(root->dx_depth == PINTFS_DX_MAX_DEPTH)
+			return -ENOSPC;
+		for(i = (1 << root->dx_depth) - 1; i >= 0; i--){
+			root->dx_slot[2*i] = root->dx_slot[2*i + 1] = root->dx_slot[i];
+			root->dx_leaf_depth[2*i] = root->dx_leaf_depth[2*i + 1] = root->dx_leaf_depth[i];
+		}
+		root->dx_depth++;
+		slot = pintfs_dx_slot(root, hash);
+	}
+
+	new_lblk = pintfs_dir_blocks(dir);
+	new_bh = pintfs_dir_bread(dir, new_lblk, 1);
+	if(IS_ERR(new_bh))
+		return PTR_ERR(new_bh);
+	dir->i_size += PINTFS_BLOCK_SIZE;
+
+	// slots of the old leaf are an aligned run, the upper half moves
+	span = 1 << (root->dx_depth - ld);
+	first = slot & ~(span - 1);
+	for(i = first; i < first + span; i++){
+		root->dx_leaf_depth[i] = ld + 1;
+		if(i >= first + span / 2)
+			root->dx_slot[i] = new_lblk;
+	}
+
+	ndb = PINTFS_DIR_BLOCK(new_bh);
+	for(i = 0; i < PINTFS_DIR_SLOTS; i++){
+		if(!db->db_tag[i])
+			continue;
+		pde = &db->db_entry[i];
+		h = pintfs_name_hash(pde->name, pde->name_len);
+		if(root->dx_slot[pintfs_dx_slot(root, h)] != new_lblk)
+			continue;
+		ndb->db_tag[i] = db->db_tag[i];
+		ndb->db_entry[i] = *pde;
+		db->db_tag[i] = 0;
+		memset(pde, 0, sizeof(*pde));
+	}
+
+	pintfs_dirty_buffer(dir->i_sb, new_bh);
+	pintfs_dirty_buffer(dir->i_sb, leaf_bh);
+	pintfs_dirty_buffer(dir->i_sb, root_bh);
+	brelse(new_bh);
+	pintfs_set_free_hint(dir, leaf_lblk, 0);
+	pintfs_set_free_hint(dir, new_lblk, 0);
+
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+   pintfs_add_entry - add 'name' -> inode to dir
+   Only the index block and one leaf are touched, unless the leaf splits.
+   Caller holds dir->i_rwsem exclusively, lookups and readdir hold it shared.
+*/
+int pintfs_add_entry(struct inode *dir, const struct qstr *name, struct inode *inode)
+{
+	struct buffer_head *bh, *root_bh;
+	struct pintfs_dir_block *db;
+	struct pintfs_dir_entry *pde;
+	unsigned int hash, lblk, hint;
+	int i, err;
+
+	if(name->len > MAX_NAME_SIZE)
+		return -ENAMETOOLONG;
+
+	hash = pintfs_name_hash(name->name, name->len);
+	for(;;){
+		bh = pintfs_dir_leaf(dir, name, &root_bh, &lblk);
+		if(IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		// start at the free slot map, a full block is not scanned at all
+		db = PINTFS_DIR_BLOCK(bh);
+		hint = pintfs_free_hint(dir, lblk);
+		i = hint < PINTFS_DIR_SLOTS ? pintfs_dir_next_tag(db, 0, hint) : -1;
+		pintfs_set_free_hint(dir, lblk, i >= 0 ? i + 1 : PINTFS_DIR_SLOTS);
+		if(i >= 0){
+			pde = &db->db_entry[i];
+			memset(pde, 0, sizeof(*pde));
+			pde->inode_number = inode->i_ino;
+			pde->name_len = name->len;
+			pde->file_type = fs_umode_to_dtype(inode->i_mode);
+			memcpy(pde->name, name->name, name->len);
+			db->db_tag[i] = pintfs_dir_tag(hash);
+			pintfs_dirty_buffer(dir->i_sb, bh);
+			brelse(bh);
+			brelse(root_bh);
+			return 0;
+		}
+
+		// leaf is full
+		if(root_bh)
+			err = pintfs_dx_split(dir, root_bh, bh, lblk, hash);
+		else
+			err = pintfs_dx_convert(dir, bh);
+		brelse(bh);
+		brelse(root_bh);
+		if(err)
+			return err;
+	}
+}
+
+/*
+   pintfs_delete_entry - free the slot of pde in directory block lblk
+   Other entries never move, so their readdir positions stay valid.
+   Caller holds dir->i_rwsem exclusively.
+*/
+void pintfs_delete_entry(struct inode *dir, unsigned int lblk,
+		struct pintfs_dir_entry *pde, struct buffer_head *bh)
+{
+	struct pintfs_dir_block *db = PINTFS_DIR_BLOCK(bh);
+	unsigned int i = pde - db->db_entry;
+
+	db->db_tag[i] = 0;
+	memset(pde, 0, sizeof(*pde));
+	pintfs_dirty_buffer(dir->i_sb, bh);
+
+	if(i < pintfs_free_hint(dir, lblk))
+		pintfs_set_free_hint(dir, lblk, i);
+}
+
 /*
    pintfs_empty_dir - to see dir is empty or not
+   Return 1 if empty, 0 if not, or a negative error.
 */
 int pintfs_empty_dir(struct inode *inode)
 {
 	struct buffer_head *bh;
-	struct pintfs_dir_entry *pde;
-	int i, num_dirs;
+	unsigned int lblk;
 
 	if (DEBUG)
 		printk("pintfs - empty_dir\n");
-	bh = pintfs_sb_bread_dir(inode);
-	if(!bh)
-		return -EINVAL;
 
-	num_dirs = PINTFS_BLOCK_SIZE / sizeof(struct pintfs_dir_entry);
+	lblk = (PINTFS_I(inode)->i_flags & PINTFS_INDEX_FL) ? 1 : 0;
+	for(; lblk < pintfs_dir_blocks(inode); lblk++){
+		bh = pintfs_dir_bread(inode, lblk, 0);
+		if(IS_ERR(bh))
+			return PTR_ERR(bh);
 
-	for(i=0; i<num_dirs; i++){
-		pde = (struct pintfs_dir_entry *)((bh->b_data) + i*sizeof(struct pintfs_dir_entry));
-		if(pde->inode_number){
+		if(memchr_inv(PINTFS_DIR_BLOCK(bh)->db_tag, 0, PINTFS_DIR_TAG_BYTES)){
 			brelse(bh);
-			return false;
+			return 0;
 		}
+		brelse(bh);
+	}
+
+	return 1;
+}
+
+/*
+   readdir cookies follow hash order, like the index does: after "." (0)
+   and ".." (1) an entry is at 2 + (name hash << PINTFS_DIR_SLOT_BITS | slot).
+   Neither part ever changes while the entry exists (a split keeps the
+   slot), and entries are returned in cookie order, so a split can't move
+   an entry behind the position of a listing. Entries that exist for the
+   whole listing are returned exactly once.
+*/
+#define PINTFS_DIR_SLOT_BITS	7
+#define PINTFS_DIR_EOF		(2 + (1LL << (32 + PINTFS_DIR_SLOT_BITS)))
+
+static int pintfs_dir_key_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+   pintfs_dx_next_slot - first index slot past the leaf at 'slot'
+*/
+static unsigned int pintfs_dx_next_slot(struct pintfs_dx_root *root, unsigned int slot)
+{
+	unsigned int ld = min(root->dx_leaf_depth[slot], (unsigned char)root->dx_depth);
+
+	return (slot | ((1U << (root->dx_depth - ld)) - 1)) + 1;
+}
+
+/*
+   pintfs_dx_readahead - start reading the next PINTFS_META_RA leaves
+   in index order from 'slot'
+*/
+static void pintfs_dx_readahead(struct inode *dir, struct pintfs_dx_root *root,
+		unsigned int slot)
+{
+	unsigned int lblk, n;
+
+	for(n = 0; n < PINTFS_META_RA && slot < (1U << root->dx_depth); n++){
+		lblk = root->dx_slot[slot];
+		if(lblk && lblk < pintfs_dir_blocks(dir))
+			pintfs_dir_readahead(dir, lblk, lblk + 1);
+		slot = pintfs_dx_next_slot(root, slot);
+	}
+}
+
+/*
+   pintfs_readdir_leaf - emit the entries of leaf lblk whose key is at
+   least 'key', in key order. keys has room for PINTFS_DIR_SLOTS.
+   Return 1 if ctx is full, 0 when the leaf is done, or a negative error.
+*/
+static int pintfs_readdir_leaf(struct inode *dir, struct dir_context *ctx,
+		unsigned int lblk, u64 key, u64 *keys)
+{
+	struct pintfs_dir_block *db;
+	struct pintfs_dir_entry *de;
+	struct buffer_head *bh;
+	int k, n = 0, j;
+	u64 kk;
+
+	bh = pintfs_dir_bread(dir, lblk, 0);
+	if(IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	db = PINTFS_DIR_BLOCK(bh);
+	for(k = 0; k < PINTFS_DIR_SLOTS; k++){
+		if(!db->db_tag[k])
+			continue;
+		de = &db->db_entry[k];
+		kk = (u64)pintfs_name_hash(de->name, de->name_len) << PINTFS_DIR_SLOT_BITS | k;
+		if(kk >= key)
+			keys[n++] = kk;
 	}
+	sort(keys, n, sizeof(u64), pintfs_dir_key_cmp, NULL);
 
+	pintfs_itable_readahead(dir, db, 0);
+	for(j = 0; j < n; j++){
+		de = &db->db_entry[keys[j] & ((1 << PINTFS_DIR_SLOT_BITS) - 1)];
+		ctx->pos = 2 + keys[j];
+		if(!dir_emit(ctx, de->name, de->name_len, de->inode_number, de->file_type)){
+			brelse(bh);
+			return 1;
+		}
+	}
 	brelse(bh);
-	return true;
+	return 0;
 }
 
 /*
    pintfs_readdir - read all dir_entry in directory
-   중단된다면 중간 ctx->pos부터 탐색이 가능하게 만들어야 한다!
+   A linear directory is one leaf; an indexed one is walked leaf by leaf
+   in slot order, from the leaf holding the hash of ctx->pos.
 */
 static int pintfs_readdir(struct file *filp, struct dir_context *ctx)
 {	
 	struct inode *i;
-	int num_dirs, k;
-	struct pintfs_dir_entry *de;
-	struct buffer_head *bh;
-	int error;
+	struct pintfs_dx_root *root;
+	struct buffer_head *root_bh;
+	unsigned int slot, lblk, n = 0;
+	u64 key, *keys;
+	int ret;
+
+	BUILD_BUG_ON(PINTFS_DIR_SLOTS > (1 << PINTFS_DIR_SLOT_BITS));
 
 	if(DEBUG)
-		printk("pintfs - readdir\n");
+		printk("pintfs - readdir pos=%lld\n", ctx->pos);
 	
+	if(!dir_emit_dots(filp, ctx))
+		return 0;
+	if(ctx->pos >= PINTFS_DIR_EOF)
+		return 0;
+
 	i = file_inode(filp);
-	bh = pintfs_sb_bread_dir(i);
-	if(!bh){
-		return -EIO;
-	}
-	num_dirs = i->i_size / sizeof(struct pintfs_dir_entry);
-	de = (struct pintfs_dir_entry *)(bh->b_data);
-	error = 0;
-	k = 0;
-	while(!error && filp->f_pos < i->i_size && k < num_dirs){
-		if(!de->inode_number)
+	key = ctx->pos - 2;
+	keys = kmalloc_array(PINTFS_DIR_SLOTS, sizeof(u64), GFP_KERNEL);
+	if(!keys)
+		return -ENOMEM;
+
+	if(!(PINTFS_I(i)->i_flags & PINTFS_INDEX_FL)){
+		ret = pintfs_readdir_leaf(i, ctx, 0, key, keys);
+		goto out;
+	}
+
+	root_bh = pintfs_dir_bread(i, 0, 0);
+	if(IS_ERR(root_bh)){
+		ret = PTR_ERR(root_bh);
+		goto out;
+	}
+	root = (struct pintfs_dx_root *)root_bh->b_data;
+	ret = -EIO;
+	if(root->dx_magic != PINTFS_DX_MAGIC || root->dx_depth > PINTFS_DX_MAX_DEPTH)
+		goto corrupt;
+
+	ret = 0;
+	slot = pintfs_dx_slot(root, key >> PINTFS_DIR_SLOT_BITS);
+	for(; slot < (1U << root->dx_depth); slot = pintfs_dx_next_slot(root, slot)){
+		// keep the next few leaves in flight while this one is parsed
+		if(n++ % PINTFS_META_RA == 0)
+			pintfs_dx_readahead(i, root, slot);
+		lblk = root->dx_slot[slot];
+		ret = -EIO;
+		if(!lblk || lblk >= pintfs_dir_blocks(i))
+			goto corrupt;
+		ret = pintfs_readdir_leaf(i, ctx, lblk, key, keys);
+		if(ret)
 			break;
-		if(!dir_emit(ctx, de->name, strnlen(de->name, MAX_NAME_SIZE), de->inode_number, DT_UNKNOWN)){
-			brelse(bh);
-			return 0;
-		}
-		ctx->pos += sizeof(struct pintfs_dir_entry);
-		de++;
-		k++;
 	}
+	brelse(root_bh);
+	goto out;
 
-	brelse(bh);
-	mark_inode_dirty(i);
+corrupt:
+	printk("pintfs - bad directory index in inode %ld\n", i->i_ino);
+	brelse(root_bh);
+out:
+	kfree(keys);
+	if(ret)
+		return ret < 0 ? ret : 0;
+	ctx->pos = PINTFS_DIR_EOF;
 	return 0;
 }
 
+/*
+   pintfs_dir_llseek - cookies go past i_size, allow seeking up to PINTFS_DIR_EOF
+*/
+static loff_t pintfs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	return generic_file_llseek_size(file, offset, whence, PINTFS_DIR_EOF,
+			i_size_read(inode));
+}
+
 /*
    DIRECTORY_OPERATIONS
 */
 const struct file_operations pintfs_dir_ops = {
-	.llseek	=	generic_file_llseek,
+	.llseek	=	pintfs_dir_llseek,
 	.read	=	generic_read_dir,
-	.iterate =	pintfs_readdir,
-	.fsync	=	generic_file_fsync,
+	.iterate_shared =	pintfs_readdir,
+	.fsync	=	pintfs_fsync,
 };
@@ -0,0 +1,783 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include "pintfs.h"
+#define DEBUG 1
+
+/*
+   Extent tree of a PINTFS_EXTENTS_FL inode.
+   The root node lives in i_block, other nodes take a whole block.
+   Extents and index entries have the same size and both begin with
+   the first file block they cover, so nodes are handled alike.
+*/
+#define EXT_ROOT(inode)		((struct pintfs_extent_header *)PINTFS_I(inode)->i_data)
+#define EXT_FIRST_EXTENT(hdr)	((struct pintfs_extent *)((hdr) + 1))
+#define EXT_FIRST_INDEX(hdr)	((struct pintfs_extent_idx *)((hdr) + 1))
+#define EXT_ENTRY_SIZE		sizeof(struct pintfs_extent)
+#define EXT_KEY(hdr, i)		(*(unsigned int *)((char *)((hdr) + 1) + (i) * EXT_ENTRY_SIZE))
+#define EXT_ROOT_MAX		((sizeof(((struct pintfs_inode *)0)->i_block) - \
+				sizeof(struct pintfs_extent_header)) / EXT_ENTRY_SIZE)
+#define EXT_BLOCK_MAX		((PINTFS_BLOCK_SIZE - sizeof(struct pintfs_extent_header)) / EXT_ENTRY_SIZE)
+#define EXT_MAX_BLOCK		0xffffffffU
+#define EXT_LEN(ex)		((ex)->ee_len & ~PINTFS_EXT_UNWRITTEN)
+#define EXT_UNWRITTEN(ex)	((ex)->ee_len & PINTFS_EXT_UNWRITTEN)
+
+/*
+   pintfs_ext_path - one node on the way from the root to a leaf
+   p_idx is the last entry whose key <= the searched block (-1 if none).
+*/
+struct pintfs_ext_path {
+	struct buffer_head *p_bh;	/* NULL for the root in the inode */
+	struct pintfs_extent_header *p_hdr;
+	int p_idx;
+};
+
+/*
+   pintfs_ext_init - make i_block an empty extent tree root
+*/
+void pintfs_ext_init(struct inode *inode)
+{
+	struct pintfs_extent_header *root = EXT_ROOT(inode);
+
+	memset(PINTFS_I(inode)->i_data, 0, sizeof(((struct pintfs_inode *)0)->i_block));
+	root->eh_magic = PINTFS_EXT_MAGIC;
+	root->eh_entries = 0;
+	root->eh_max = EXT_ROOT_MAX;
+	root->eh_depth = 0;
+}
+
+static void pintfs_ext_put_path(struct pintfs_ext_path *path, int depth)
+{
+	int i;
+
+	for(i = 0; i <= depth; i++){
+		brelse(path[i].p_bh);
+		path[i].p_bh = NULL;
+	}
+}
+
+static bool pintfs_ext_bad_node(struct pintfs_extent_header *hdr, int depth, unsigned int max)
+{
+	return hdr->eh_magic != PINTFS_EXT_MAGIC || hdr->eh_depth != depth ||
+		hdr->eh_max > max || hdr->eh_entries > hdr->eh_max;
+}
+
+/*
+   pintfs_ext_search - binary search for the last entry whose key <= lblk
+*/
+static int pintfs_ext_search(struct pintfs_extent_header *hdr, unsigned int lblk)
+{
+	int lo = 0, hi = hdr->eh_entries - 1, mid, found = -1;
+
+	while(lo <= hi){
+		mid = (lo + hi) / 2;
+		if(EXT_KEY(hdr, mid) <= lblk){
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+	return found;
+}
+
+/*
+   pintfs_ext_readahead - child idx of hdr is about to be read; if it
+   misses the cache, start reading the next few children as well
+*/
+static void pintfs_ext_readahead(struct super_block *sb, struct pintfs_extent_header *hdr,
+		int idx)
+{
+	struct pintfs_extent_idx *ix = EXT_FIRST_INDEX(hdr);
+	int n;
+
+	if(pintfs_block_cached(sb, ix[idx].ei_leaf))
+		return;
+	for(n = idx + 1; n <= idx + PINTFS_META_RA && n < hdr->eh_entries; n++)
+		sb_breadahead(sb, ix[n].ei_leaf);
+}
+
+/*
+   pintfs_ext_find - fill path[] from the root to the leaf that covers lblk
+   Return the depth of the tree. With nowait, a tree block that is not
+   cached gives -EAGAIN instead of a read.
+*/
+static int pintfs_ext_find(struct inode *inode, unsigned int lblk, struct pintfs_ext_path *path,
+		bool nowait)
+{
+	struct pintfs_extent_header *hdr = EXT_ROOT(inode);
+	struct buffer_head *bh;
+	int depth, level, idx;
+
+	if(hdr->eh_magic != PINTFS_EXT_MAGIC || hdr->eh_depth > PINTFS_EXT_MAX_DEPTH ||
+			hdr->eh_entries > hdr->eh_max)
+		goto corrupt;
+
+	depth = hdr->eh_depth;
+	path[0].p_bh = NULL;
+	for(level = 0; ; level++){
+		idx = pintfs_ext_search(hdr, lblk);
+		path[level].p_hdr = hdr;
+		path[level].p_idx = idx;
+		if(level == depth)
+			return depth;
+
+		if(!hdr->eh_entries){
+			pintfs_ext_put_path(path, level);
+			goto corrupt;
+		}
+		if(idx < 0)
+			path[level].p_idx = idx = 0;
+
+		if(nowait){
+			bh = pintfs_bread_cached(inode->i_sb, EXT_FIRST_INDEX(hdr)[idx].ei_leaf);
+			if(!bh){
+				pintfs_ext_put_path(path, level);
+				return -EAGAIN;
+			}
+		}
+		else{
+			pintfs_ext_readahead(inode->i_sb, hdr, idx);
+			bh = sb_bread(inode->i_sb, EXT_FIRST_INDEX(hdr)[idx].ei_leaf);
+			if(!bh){
+				pintfs_ext_put_path(path, level);
+				return -EIO;
+			}
+		}
+		path[level + 1].p_bh = bh;
+		hdr = (struct pintfs_extent_header *)bh->b_data;
+		if(pintfs_ext_bad_node(hdr, depth - level - 1, EXT_BLOCK_MAX)){
+			pintfs_ext_put_path(path, level + 1);
+			goto corrupt;
+		}
+	}
+
+corrupt:
+	printk("pintfs - extent tree of inode %ld is corrupted\n", inode->i_ino);
+	return -EIO;
+}
+
+/*
+   pintfs_ext_next_key - first file block mapped after the leaf slot in path
+*/
+static unsigned int pintfs_ext_next_key(struct pintfs_ext_path *path, int depth)
+{
+	int level;
+
+	for(level = depth; level >= 0; level--){
+		if(path[level].p_idx + 1 < path[level].p_hdr->eh_entries)
+			return EXT_KEY(path[level].p_hdr, path[level].p_idx + 1);
+	}
+	return EXT_MAX_BLOCK;
+}
+
+static void pintfs_ext_dirty(struct inode *inode, struct pintfs_ext_path *p)
+{
+	if(p->p_bh)
+		pintfs_dirty_buffer(inode->i_sb, p->p_bh);
+	else{
+		mark_inode_dirty(inode);
+	}
+}
+
+/*
+   pintfs_ext_new_node - alloc an empty tree block for nodes at 'depth'
+*/
+static struct buffer_head *pintfs_ext_new_node(struct inode *inode, int depth,
+		unsigned int *bno)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pintfs_extent_header *hdr;
+	struct buffer_head *bh;
+	int block_no;
+
+	// tree blocks go along with the data they map
+	block_no = pintfs_empty_block(inode, PINTFS_I(inode)->i_next_pblk);
+	if(block_no < 0)
+		return ERR_PTR(-ENOSPC);
+
+	bh = sb_getblk(sb, block_no);
+	if(!bh){
+		pintfs_free_block(sb, block_no);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PINTFS_BLOCK_SIZE);
+	hdr = (struct pintfs_extent_header *)bh->b_data;
+	hdr->eh_magic = PINTFS_EXT_MAGIC;
+	hdr->eh_max = EXT_BLOCK_MAX;
+	hdr->eh_depth = depth;
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	*bno = block_no;
+	return bh;
+}
+
+/*
+   pintfs_ext_grow - move the full root into a new block, one level deeper
+*/
+static int pintfs_ext_grow(struct inode *inode)
+{
+	struct pintfs_extent_header *root = EXT_ROOT(inode), *hdr;
+	struct pintfs_extent_idx *ix;
+	struct buffer_head *bh;
+	unsigned int bno;
+
+	if(root->eh_depth >= PINTFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+
+	bh = pintfs_ext_new_node(inode, root->eh_depth, &bno);
+	if(IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	hdr = (struct pintfs_extent_header *)bh->b_data;
+	memcpy(hdr + 1, root + 1, root->eh_entries * EXT_ENTRY_SIZE);
+	hdr->eh_entries = root->eh_entries;
+	pintfs_dirty_buffer(inode->i_sb, bh);
+	brelse(bh);
+
+	ix = EXT_FIRST_INDEX(root);
+	ix->ei_block = root->eh_entries ? EXT_KEY(hdr, 0) : 0;
+	ix->ei_leaf = bno;
+	ix->ei_unused = 0;
+	root->eh_entries = 1;
+	root->eh_depth++;
+
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+   pintfs_ext_split - move the upper half of the full node path[level] into
+   a new sibling. The parent must have a free slot.
+*/
+static int pintfs_ext_split(struct inode *inode, struct pintfs_ext_path *path, int level)
+{
+	struct pintfs_extent_header *hdr = path[level].p_hdr, *nhdr;
+	struct pintfs_ext_path *parent = &path[level - 1];
+	struct pintfs_extent_idx *ix;
+	struct buffer_head *bh;
+	unsigned int bno;
+	int half, pos;
+
+	bh = pintfs_ext_new_node(inode, hdr->eh_depth, &bno);
+	if(IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	half = hdr->eh_entries / 2;
+	nhdr = (struct pintfs_extent_header *)bh->b_data;
+	nhdr->eh_entries = hdr->eh_entries - half;
+	memcpy(nhdr + 1, (char *)(hdr + 1) + half * EXT_ENTRY_SIZE,
+			nhdr->eh_entries * EXT_ENTRY_SIZE);
+	hdr->eh_entries = half;
+	pintfs_dirty_buffer(inode->i_sb, bh);
+	pintfs_ext_dirty(inode, &path[level]);
+
+	// index the new node right after the old one
+	pos = parent->p_idx + 1;
+	ix = EXT_FIRST_INDEX(parent->p_hdr) + pos;
+	memmove(ix + 1, ix, (parent->p_hdr->eh_entries - pos) * EXT_ENTRY_SIZE);
+	ix->ei_block = EXT_KEY(nhdr, 0);
+	ix->ei_leaf = bno;
+	ix->ei_unused = 0;
+	parent->p_hdr->eh_entries++;
+	pintfs_ext_dirty(inode, parent);
+
+	brelse(bh);
+	return 0;
+}
+
+/*
+   pintfs_ext_make_room - split the full leaf in path, or the lowest full
+   ancestor whose parent has room, or grow the tree at the root.
+*/
+static int pintfs_ext_make_room(struct inode *inode, struct pintfs_ext_path *path, int depth)
+{
+	int level = depth;
+
+	while(level > 0 && path[level - 1].p_hdr->eh_entries == path[level - 1].p_hdr->eh_max)
+		level--;
+
+	if(level == 0)
+		return pintfs_ext_grow(inode);
+	return pintfs_ext_split(inode, path, level);
+}
+
+/*
+   pintfs_ext_fix_index - lower the index keys above a leaf whose first key became lblk
+*/
+static void pintfs_ext_fix_index(struct inode *inode, struct pintfs_ext_path *path,
+		int depth, unsigned int lblk)
+{
+	struct pintfs_extent_idx *ix;
+	int level;
+
+	for(level = depth - 1; level >= 0; level--){
+		ix = EXT_FIRST_INDEX(path[level].p_hdr) + path[level].p_idx;
+		if(ix->ei_block <= lblk)
+			break;
+		ix->ei_block = lblk;
+		pintfs_ext_dirty(inode, &path[level]);
+	}
+}
+
+/*
+   pintfs_ext_insert - map file blocks [lblk, lblk+len) to disk blocks from pblk
+   The range must be a hole. flag is 0 or PINTFS_EXT_UNWRITTEN.
+   Merge with a neighbouring extent in the same state when possible.
+*/
+static int pintfs_ext_insert(struct inode *inode, unsigned int lblk,
+		unsigned int pblk, unsigned int len, unsigned int flag)
+{
+	struct pintfs_ext_path path[PINTFS_EXT_MAX_DEPTH + 1];
+	struct pintfs_extent_header *hdr;
+	struct pintfs_extent *ex;
+	int depth, idx, ret;
+
+	for(;;){
+		depth = pintfs_ext_find(inode, lblk, path, false);
+		if(depth < 0)
+			return depth;
+
+		hdr = path[depth].p_hdr;
+		ex = EXT_FIRST_EXTENT(hdr);
+		idx = path[depth].p_idx;
+
+		if(idx >= 0 && EXT_UNWRITTEN(&ex[idx]) == flag &&
+				ex[idx].ee_block + EXT_LEN(&ex[idx]) == lblk &&
+				ex[idx].ee_start + EXT_LEN(&ex[idx]) == pblk){
+			ex[idx].ee_len += len;
+			pintfs_ext_dirty(inode, &path[depth]);
+			ret = 0;
+			break;
+		}
+
+		if(idx + 1 < hdr->eh_entries && EXT_UNWRITTEN(&ex[idx + 1]) == flag &&
+				lblk + len == ex[idx + 1].ee_block &&
+				pblk + len == ex[idx + 1].ee_start){
+			ex[idx + 1].ee_block = lblk;
+			ex[idx + 1].ee_start = pblk;
+			ex[idx + 1].ee_len += len;
+			pintfs_ext_dirty(inode, &path[depth]);
+			if(idx < 0)
+				pintfs_ext_fix_index(inode, path, depth, lblk);
+			ret = 0;
+			break;
+		}
+
+		if(hdr->eh_entries < hdr->eh_max){
+			idx++;
+			memmove(&ex[idx + 1], &ex[idx], (hdr->eh_entries - idx) * EXT_ENTRY_SIZE);
+			ex[idx].ee_block = lblk;
+			ex[idx].ee_start = pblk;
+			ex[idx].ee_len = len | flag;
+			hdr->eh_entries++;
+			pintfs_ext_dirty(inode, &path[depth]);
+			if(idx == 0)
+				pintfs_ext_fix_index(inode, path, depth, lblk);
+			ret = 0;
+			break;
+		}
+
+		// leaf is full: make room and look the leaf up again
+		ret = pintfs_ext_make_room(inode, path, depth);
+		pintfs_ext_put_path(path, depth);
+		if(ret)
+			return ret;
+	}
+
+	pintfs_ext_put_path(path, depth);
+	return ret;
+}
+
+/*
+   pintfs_ext_map - look iblock up, caller holds i_map_sem
+   Return the length of the run at iblock, at most maxblocks. *pblk is its
+   first disk block or 0 for a hole; for a hole *near is where the extent
+   in front of it would continue. nowait: see pintfs_ext_find.
+*/
+int pintfs_ext_map(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		unsigned int *pblk, bool *unwritten, unsigned int *near, bool nowait)
+{
+	struct pintfs_ext_path path[PINTFS_EXT_MAX_DEPTH + 1];
+	struct pintfs_extent *ex;
+	unsigned int lblk = iblock, end;
+	int depth, idx;
+
+	*pblk = 0;
+	*unwritten = false;
+	*near = 0;
+	if(iblock >= EXT_MAX_BLOCK)
+		return -EFBIG;
+
+	depth = pintfs_ext_find(inode, lblk, path, nowait);
+	if(depth < 0)
+		return depth;
+
+	idx = path[depth].p_idx;
+	ex = EXT_FIRST_EXTENT(path[depth].p_hdr) + idx;
+	if(idx >= 0 && lblk < ex->ee_block + EXT_LEN(ex)){
+		*pblk = ex->ee_start + (lblk - ex->ee_block);
+		*unwritten = EXT_UNWRITTEN(ex);
+		end = ex->ee_block + EXT_LEN(ex);
+	}
+	else{
+		end = pintfs_ext_next_key(path, depth);
+		// continue the extent in front of the hole
+		if(idx >= 0)
+			*near = ex->ee_start + (lblk - ex->ee_block);
+	}
+	pintfs_ext_put_path(path, depth);
+	return min_t(unsigned int, maxblocks, end - lblk);
+}
+
+/*
+   pintfs_ext_convert - mark [lblk, lblk+len) written
+   The range lies inside one unwritten extent, which is split around it.
+   A written piece at the head joins the extent in front when the blocks
+   follow on, so filling a preallocated file in order keeps one extent.
+*/
+static int pintfs_ext_convert(struct inode *inode, unsigned int lblk, unsigned int len)
+{
+	struct pintfs_ext_path path[PINTFS_EXT_MAX_DEPTH + 1];
+	struct pintfs_extent_header *hdr;
+	struct pintfs_extent *ex, orig;
+	unsigned int head, tail, pieces;
+	int depth, idx, ret, i;
+
+	for(;;){
+		depth = pintfs_ext_find(inode, lblk, path, false);
+		if(depth < 0)
+			return depth;
+
+		hdr = path[depth].p_hdr;
+		idx = path[depth].p_idx;
+		ex = EXT_FIRST_EXTENT(hdr) + idx;
+		if(idx < 0 || !EXT_UNWRITTEN(ex) || lblk + len > ex->ee_block + EXT_LEN(ex)){
+			pintfs_ext_put_path(path, depth);
+			return -EIO;
+		}
+		orig = *ex;
+		head = lblk - orig.ee_block;
+		tail = EXT_LEN(&orig) - head - len;
+
+		if(!head && idx > 0 && !EXT_UNWRITTEN(ex - 1) &&
+				ex[-1].ee_block + ex[-1].ee_len == lblk &&
+				ex[-1].ee_start + ex[-1].ee_len == orig.ee_start){
+			ex[-1].ee_len += len;
+			if(tail){
+				ex->ee_block += len;
+				ex->ee_start += len;
+				ex->ee_len = tail | PINTFS_EXT_UNWRITTEN;
+			}
+			else{
+				memmove(ex, ex + 1, (hdr->eh_entries - idx - 1) * EXT_ENTRY_SIZE);
+				hdr->eh_entries--;
+			}
+			ret = 0;
+			break;
+		}
+
+		pieces = 1 + !!head + !!tail;
+		if(hdr->eh_entries + pieces - 1 <= hdr->eh_max){
+			memmove(ex + pieces, ex + 1, (hdr->eh_entries - idx - 1) * EXT_ENTRY_SIZE);
+			i = 0;
+			if(head){
+				ex[i].ee_len = head | PINTFS_EXT_UNWRITTEN;
+				i++;
+			}
+			ex[i].ee_block = lblk;
+			ex[i].ee_start = orig.ee_start + head;
+			ex[i].ee_len = len;
+			if(tail){
+				i++;
+				ex[i].ee_block = lblk + len;
+				ex[i].ee_start = orig.ee_start + head + len;
+				ex[i].ee_len = tail | PINTFS_EXT_UNWRITTEN;
+			}
+			hdr->eh_entries += pieces - 1;
+			ret = 0;
+			break;
+		}
+
+		// leaf is full: make room and look the leaf up again
+		ret = pintfs_ext_make_room(inode, path, depth);
+		pintfs_ext_put_path(path, depth);
+		if(ret)
+			return ret;
+	}
+
+	pintfs_ext_dirty(inode, &path[depth]);
+	pintfs_ext_put_path(path, depth);
+	return ret;
+}
+
+/*
+   pintfs_ext_get_blocks - extent version of pintfs_get_blocks
+   A mapped run is as long as the extent holding iblock allows.
+   Unwritten blocks look like a hole until create converts them.
+*/
+int pintfs_ext_get_blocks(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		int create, unsigned int *bno, bool *new)
+{
+	unsigned int lblk = iblock, near, pblk, count;
+	bool unwritten;
+	int block_no, ret;
+
+	*bno = 0;
+	*new = false;
+	if(iblock >= EXT_MAX_BLOCK)
+		return -EFBIG;
+
+	ret = pintfs_ext_map(inode, lblk, maxblocks, &pblk, &unwritten, &near, false);
+	if(ret < 0)
+		return ret;
+	count = ret;
+	if(pblk && !unwritten)
+		*bno = pblk;
+	if(*bno || !create)
+		return count;
+
+	if(unwritten){
+		// blocks are there already, only their state changes
+		ret = pintfs_ext_convert(inode, lblk, count);
+		if(ret)
+			return ret;
+		block_no = pblk;
+	}
+	else{
+		// the whole hole run becomes one extent
+		block_no = pintfs_new_blocks(inode, pintfs_find_goal(inode, lblk, near), &count);
+		if(block_no < 0)
+			return -ENOSPC;
+
+		ret = pintfs_ext_insert(inode, lblk, block_no, count, 0);
+		if(ret){
+			pintfs_free_blocks(inode->i_sb, block_no, count);
+			return ret;
+		}
+	}
+
+	PINTFS_I(inode)->i_next_lblk = lblk + count;
+	PINTFS_I(inode)->i_next_pblk = block_no + count;
+	*bno = block_no;
+	*new = true;
+	return count;
+}
+
+/*
+   pintfs_ext_prealloc - back every hole in [lblk, lblk+count) with
+   unwritten blocks. Caller holds i_map_sem exclusively.
+*/
+int pintfs_ext_prealloc(struct inode *inode, unsigned int lblk, unsigned int count)
+{
+	unsigned int pblk, near, len;
+	bool unwritten;
+	int block_no, ret;
+
+	while(count){
+		if(fatal_signal_pending(current))
+			return -EINTR;
+
+		ret = pintfs_ext_map(inode, lblk, count, &pblk, &unwritten, &near, false);
+		if(ret < 0)
+			return ret;
+		len = ret;
+		if(!pblk){
+			block_no = pintfs_new_blocks(inode, pintfs_find_goal(inode, lblk, near), &len);
+			if(block_no < 0)
+				return -ENOSPC;
+
+			ret = pintfs_ext_insert(inode, lblk, block_no, len, PINTFS_EXT_UNWRITTEN);
+			if(ret){
+				pintfs_free_blocks(inode->i_sb, block_no, len);
+				return ret;
+			}
+			PINTFS_I(inode)->i_next_lblk = lblk + len;
+			PINTFS_I(inode)->i_next_pblk = block_no + len;
+		}
+		lblk += len;
+		count -= len;
+	}
+	return 0;
+}
+
+/*
+   pintfs_ext_punch - free every block mapped in [first, end)
+   A leaf left empty is dropped from its parent unless it is the only child.
+   Caller holds i_map_sem exclusively.
+*/
+int pintfs_ext_punch(struct inode *inode, unsigned int first, unsigned int end)
+{
+	struct pintfs_ext_path path[PINTFS_EXT_MAX_DEPTH + 1];
+	struct super_block *sb = inode->i_sb;
+	struct pintfs_extent_header *hdr, *parent;
+	struct pintfs_extent *ex;
+	unsigned int lblk = first, ex_end, cut_end, flag, next, leaf;
+	int depth, idx, ret = 0;
+
+	while(lblk < end){
+		depth = pintfs_ext_find(inode, lblk, path, false);
+		if(depth < 0)
+			return depth;
+
+		hdr = path[depth].p_hdr;
+		idx = path[depth].p_idx;
+		ex = EXT_FIRST_EXTENT(hdr) + idx;
+		if(idx < 0 || lblk >= ex->ee_block + EXT_LEN(ex)){
+			next = pintfs_ext_next_key(path, depth);
+			pintfs_ext_put_path(path, depth);
+			lblk = next;
+			continue;
+		}
+
+		flag = EXT_UNWRITTEN(ex);
+		ex_end = ex->ee_block + EXT_LEN(ex);
+		cut_end = min(ex_end, end);
+		if(lblk > ex->ee_block && cut_end < ex_end){
+			// hole in the middle: the extent becomes two
+			if(hdr->eh_entries == hdr->eh_max){
+				ret = pintfs_ext_make_room(inode, path, depth);
+				pintfs_ext_put_path(path, depth);
+				if(ret)
+					return ret;
+				continue;
+			}
+			memmove(ex + 2, ex + 1, (hdr->eh_entries - idx - 1) * EXT_ENTRY_SIZE);
+			ex[1].ee_block = cut_end;
+			ex[1].ee_start = ex->ee_start + (cut_end - ex->ee_block);
+			ex[1].ee_len = (ex_end - cut_end) | flag;
+			hdr->eh_entries++;
+			pintfs_free_blocks(sb, ex->ee_start + (lblk - ex->ee_block), cut_end - lblk);
+			ex->ee_len = (lblk - ex->ee_block) | flag;
+		}
+		else if(lblk > ex->ee_block){
+			pintfs_free_blocks(sb, ex->ee_start + (lblk - ex->ee_block), cut_end - lblk);
+			ex->ee_len = (lblk - ex->ee_block) | flag;
+		}
+		else if(cut_end < ex_end){
+			pintfs_free_blocks(sb, ex->ee_start, cut_end - ex->ee_block);
+			ex->ee_start += cut_end - ex->ee_block;
+			ex->ee_block = cut_end;
+			ex->ee_len = (ex_end - cut_end) | flag;
+		}
+		else{
+			pintfs_free_blocks(sb, ex->ee_start, EXT_LEN(ex));
+			memmove(ex, ex + 1, (hdr->eh_entries - idx - 1) * EXT_ENTRY_SIZE);
+			hdr->eh_entries--;
+		}
+
+		parent = depth ? path[depth - 1].p_hdr : NULL;
+		if(!hdr->eh_entries && parent && parent->eh_entries > 1){
+			idx = path[depth - 1].p_idx;
+			leaf = EXT_FIRST_INDEX(parent)[idx].ei_leaf;
+			memmove(EXT_FIRST_INDEX(parent) + idx, EXT_FIRST_INDEX(parent) + idx + 1,
+					(parent->eh_entries - idx - 1) * EXT_ENTRY_SIZE);
+			parent->eh_entries--;
+			pintfs_ext_dirty(inode, &path[depth - 1]);
+			bforget(path[depth].p_bh);
+			path[depth].p_bh = NULL;
+			pintfs_free_block(sb, leaf);
+		}
+		else
+			pintfs_ext_dirty(inode, &path[depth]);
+		pintfs_ext_put_path(path, depth);
+		lblk = cut_end;
+	}
+
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+   pintfs_ext_trunc_node - drop everything at or past file block 'first' under hdr
+*/
+static int pintfs_ext_trunc_node(struct inode *inode, struct pintfs_extent_header *hdr,
+		unsigned int first)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pintfs_extent_header *child;
+	struct pintfs_extent *ex;
+	struct pintfs_extent_idx *ix;
+	struct buffer_head *bh;
+	unsigned int keep;
+	int err;
+
+	if(hdr->eh_depth == 0){
+		while(hdr->eh_entries){
+			ex = EXT_FIRST_EXTENT(hdr) + hdr->eh_entries - 1;
+			if(ex->ee_block >= first){
+				pintfs_free_blocks(sb, ex->ee_start, EXT_LEN(ex));
+				hdr->eh_entries--;
+				continue;
+			}
+			if(ex->ee_block + EXT_LEN(ex) > first){
+				keep = first - ex->ee_block;
+				pintfs_free_blocks(sb, ex->ee_start + keep, EXT_LEN(ex) - keep);
+				ex->ee_len = keep | EXT_UNWRITTEN(ex);
+			}
+			break;
+		}
+		return 0;
+	}
+
+	while(hdr->eh_entries){
+		ix = EXT_FIRST_INDEX(hdr) + hdr->eh_entries - 1;
+		bh = sb_bread(sb, ix->ei_leaf);
+		if(!bh)
+			return -EIO;
+		child = (struct pintfs_extent_header *)bh->b_data;
+		if(pintfs_ext_bad_node(child, hdr->eh_depth - 1, EXT_BLOCK_MAX)){
+			brelse(bh);
+			return -EIO;
+		}
+
+		err = pintfs_ext_trunc_node(inode, child, first);
+		if(err){
+			brelse(bh);
+			return err;
+		}
+
+		if(!child->eh_entries){
+			bforget(bh);
+			pintfs_free_block(sb, ix->ei_leaf);
+			hdr->eh_entries--;
+			continue;
+		}
+
+		// child still maps blocks before 'first', so do all earlier ones
+		pintfs_dirty_buffer(sb, bh);
+		brelse(bh);
+		break;
+	}
+	return 0;
+}
+
+/*
+   pintfs_ext_truncate - free every block mapped at or past file block 'first'
+*/
+int pintfs_ext_truncate(struct inode *inode, unsigned long first)
+{
+	struct pintfs_extent_header *root = EXT_ROOT(inode);
+	int err;
+
+	if(DEBUG)
+		printk("pintfs - ext_truncate ino=%ld first=%lu\n", inode->i_ino, first);
+
+	if(pintfs_ext_bad_node(root, root->eh_depth, EXT_ROOT_MAX) ||
+			root->eh_depth > PINTFS_EXT_MAX_DEPTH)
+		return -EIO;
+	if(first >= EXT_MAX_BLOCK)
+		return 0;
+
+	err = pintfs_ext_trunc_node(inode, root, first);
+	if(!root->eh_entries)
+		root->eh_depth = 0;
+
+	mark_inode_dirty(inode);
+	return err;
+}
@@ -3,185 +3,1463 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
-#include <linux/uaccess.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
+#include <linux/pagevec.h>
+#include <linux/iomap.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
 #include "pintfs.h"
 #define DEBUG 1
 
 /*
-	pintfs_need_file_ectension - to know inode should alloc more blocks!
+   pintfs_block_to_path - split file block 'iblock' into slot offsets per level
+   i_block[0..5] are direct, i_block[6] is indirect, i_block[7] is double indirect.
+   *boundary is the number of slots after the last one in the same map block.
+   Return the depth of the path (1~3), 0 if iblock is too big.
 */
-static bool pintfs_need_file_extension(struct inode *inode, int index){
-	return PINTFS_I(inode)->i_data[index] == 0;
+static int pintfs_block_to_path(unsigned long iblock, int offsets[3], int *boundary)
+{
+	const unsigned long apb = PINTFS_ADDR_PER_BLOCK;
+
+	if(iblock < PINTFS_NDIR_BLOCKS){
+		offsets[0] = iblock;
+		*boundary = PINTFS_NDIR_BLOCKS - 1 - iblock;
+		return 1;
+	}
+	iblock -= PINTFS_NDIR_BLOCKS;
+	if(iblock < apb){
+		offsets[0] = PINTFS_IND_BLOCK;
+		offsets[1] = iblock;
+		*boundary = apb - 1 - iblock;
+		return 2;
+	}
+	iblock -= apb;
+	if(iblock < apb * apb){
+		offsets[0] = PINTFS_DIND_BLOCK;
+		offsets[1] = iblock / apb;
+		offsets[2] = iblock % apb;
+		*boundary = apb - 1 - offsets[2];
+		return 3;
+	}
+	return 0;
 }
+
 /*
-   pintfs_expand_file - alloc new block for inode
+   pintfs_find_near - a disk block near slot p of a map array
+   The closest mapped slot before p, moved up by the distance to p,
+   else the block right after the map block holding the array.
 */
-static int pintfs_expand_file(struct inode *inode, int index)
+static unsigned int pintfs_find_near(unsigned int *start, unsigned int *p,
+		struct buffer_head *bh)
 {
-	
-	struct super_block *sb = inode->i_sb;
-	struct pintfs_inode_info *pii;
-	int block_no;
+	unsigned int *q;
 
-	if(DEBUG)
-		printk("pintfs - expand_file\n");
+	for(q = p - 1; q >= start; q--)
+		if(*q)
+			return *q + (p - q);
+	return bh ? bh->b_blocknr + 1 : 0;
+}
 
-	pii = PINTFS_I(inode);
-	if(pii->i_data[index] > 0)
-		return 0;
+/*
+   pintfs_map_readahead - *p is about to be read from a map block that ends
+   at 'end'. If it misses the cache, start reading the map blocks listed
+   after it too, so a long sequential read doesn't stall on each of them.
+*/
+static void pintfs_map_readahead(struct super_block *sb, unsigned int *p, unsigned int *end)
+{
+	int n;
+
+	if(pintfs_block_cached(sb, *p))
+		return;
+	for(n = 1; n <= PINTFS_META_RA && p + n < end; n++){
+		if(p[n])
+			sb_breadahead(sb, p[n]);
+	}
+}
+
+/*
+   pintfs_alloc_map_block - alloc a zero filled indirect block
+*/
+static int pintfs_alloc_map_block(struct inode *inode, unsigned int goal)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	int block_no;
 
-	block_no = pintfs_empty_block(sb);
-	
+	block_no = pintfs_empty_block(inode, goal);
 	if(block_no < 0)
-		return -ENOMEM;
+		return -ENOSPC;
 
-	pii->i_data[index] = block_no;
-	set_bitmap(sb, PINTFS_BLOCK_BITMAP_BLOCK, block_no, 1);
-	// when inode changes, write immediately!
-	pintfs_write_inode(sb, inode);
-	mark_inode_dirty(inode);
+	bh = sb_getblk(sb, block_no);
+	if(!bh){
+		pintfs_free_block(sb, block_no);
+		return -ENOMEM;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PINTFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	pintfs_dirty_buffer(sb, bh);
+	brelse(bh);
 	return block_no;
 }
+
 /*
-   pintfs_read - read file
+   __pintfs_get_blocks - map up to maxblocks file blocks starting at iblock
+   Return the length of the run found: *bno is its first disk block, or 0 for a hole.
+   The run never leaves one map block, so a single lookup serves a whole
+   indirect block worth of sequential I/O. If create is set, a hole at iblock
+   is filled with one contiguous run of up to maxblocks new blocks
+   (*new = true). A lookup with nowait gives -EAGAIN rather than read a
+   map block that is not cached. Caller holds i_map_sem.
 */
-static ssize_t pintfs_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+static int __pintfs_get_blocks(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		int create, unsigned int *bno, bool *new, bool nowait)
 {
-	struct buffer_head *bh;
-	struct inode *inode = filp->f_inode;
-	char *start;
-	struct super_block *sb;
-	int index, offset, bytes_to_read, bytes_read, block_read;
+	struct super_block *sb = inode->i_sb;
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	struct buffer_head *bh = NULL, *next;
+	unsigned int *p, *start, goal, len;
+	int offsets[3], depth, boundary, level, count, ret;
+	bool inode_changed = false;
 
-	if(DEBUG)
-		printk("pintfs - file read - count: %zu ppos %Ld\n", count, *ppos);
+	if(PINTFS_I(inode)->i_flags & PINTFS_EXTENTS_FL)
+		return pintfs_ext_get_blocks(inode, iblock, maxblocks, create, bno, new);
+	// inline data has no blocks, it must be converted first
+	if(PINTFS_I(inode)->i_flags & PINTFS_INLINE_DATA_FL)
+		return -EIO;
 
-	if(!inode){
-		printk("pintfs - Problem with file inode\n");
-		return -EINVAL;
+	*bno = 0;
+	*new = false;
+	depth = pintfs_block_to_path(iblock, offsets, &boundary);
+	if(!depth)
+		return -EFBIG;
+	if(maxblocks > boundary + 1)
+		maxblocks = boundary + 1;
+
+	start = pii->i_data;
+	p = start + offsets[0];
+	for(level = 1; level < depth; level++){
+		if(!*p){
+			if(!create){
+				// whole map block is missing
+				ret = maxblocks;
+				goto out;
+			}
+			// map blocks go right in front of the data they map
+			goal = pintfs_find_goal(inode, iblock, pintfs_find_near(start, p, bh));
+			ret = pintfs_alloc_map_block(inode, goal);
+			if(ret < 0)
+				goto out;
+			*p = ret;
+			if(bh)
+				pintfs_dirty_buffer(sb, bh);
+			else
+				inode_changed = true;
+		}
+		if(nowait){
+			next = pintfs_bread_cached(sb, *p);
+			brelse(bh);
+			bh = next;
+			if(!bh){
+				ret = -EAGAIN;
+				goto out;
+			}
+		}
+		else{
+			if(bh)
+				pintfs_map_readahead(sb, p, start + PINTFS_ADDR_PER_BLOCK);
+			next = sb_bread(sb, *p);
+			brelse(bh);
+			bh = next;
+			if(!bh){
+				ret = -EIO;
+				goto out;
+			}
+		}
+		start = (unsigned int *)bh->b_data;
+		p = start + offsets[level];
 	}
 
-	if(!(S_ISREG(inode->i_mode))){
-		printk("pintfs - not regular file\n");
-		return -EINVAL;
+	if(*p){
+		*bno = *p;
+		for(count = 1; count < maxblocks && p[count] == *bno + count; count++)
+			;
+	}
+	else if(!create){
+		for(count = 1; count < maxblocks && !p[count]; count++)
+			;
 	}
+	else{
+		// fill as much of the hole as the caller maps in one run
+		for(len = 1; len < maxblocks && !p[len]; len++)
+			;
+		goal = pintfs_find_goal(inode, iblock, pintfs_find_near(start, p, bh));
+		ret = pintfs_new_blocks(inode, goal, &len);
+		if(ret < 0){
+			ret = -ENOSPC;
+			goto out;
+		}
+		for(count = 0; count < len; count++)
+			p[count] = ret + count;
+		*bno = ret;
+		pii->i_next_lblk = iblock + count;
+		pii->i_next_pblk = ret + count;
+		*new = true;
+		if(bh)
+			pintfs_dirty_buffer(sb, bh);
+		else
+			inode_changed = true;
+	}
+	ret = count;
+out:
+	brelse(bh);
+	// i_block changed, writeback picks the inode up
+	if(inode_changed)
+		mark_inode_dirty(inode);
+	return ret;
+}
 
-	if(*ppos > inode->i_size || count <= 0){
-		printk("pintfs - attempting to write over the end of a file.\n");
-		return 0;
-	}	
-	sb = inode->i_sb;
-	start = buf;
-
-	printk("pintfs - readblock\n");	
-	index = *ppos / PINTFS_BLOCK_SIZE;
-	offset = *ppos % PINTFS_BLOCK_SIZE;
-	
-	bytes_to_read = min(count, (size_t)(inode->i_size - *ppos));
-	bytes_read = 0;
-
-	printk("pintfs - copy to user\n");
-	while(bytes_read < bytes_to_read)
-	{
-		bh = pintfs_sb_bread_file(inode, index);	
+/*
+   pintfs_get_blocks - the one block mapping routine for read, write and truncate
+   Lookups share i_map_sem. Only filling a hole takes it exclusively,
+   so readers and writers of already mapped blocks never wait on each other.
+   create == PINTFS_CREATE_RESERVED allocates for delayed buffers and may
+   use the space reserved for them.
+*/
+int pintfs_get_blocks(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		int create, unsigned int *bno, bool *new)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	int ret;
+
+	down_read(&pii->i_map_sem);
+	ret = __pintfs_get_blocks(inode, iblock, maxblocks, 0, bno, new, false);
+	up_read(&pii->i_map_sem);
+	if(ret <= 0 || *bno || !create)
+		return ret;
+
+	// someone may fill the hole between the two locks, so look again
+	down_write(&pii->i_map_sem);
+	pii->i_alloc_reserved = create == PINTFS_CREATE_RESERVED;
+	ret = __pintfs_get_blocks(inode, iblock, maxblocks, 1, bno, new, false);
+	pii->i_alloc_reserved = false;
+	up_write(&pii->i_map_sem);
+	return ret;
+}
+
+/*
+   pintfs_map_blocks - look the run at iblock up without allocating
+   Like pintfs_get_blocks without create, except that an unwritten run
+   keeps its disk address in *bno and sets *unwritten. With nowait, a
+   busy i_map_sem or a map block that needs reading gives -EAGAIN
+   instead of sleeping.
+*/
+static int pintfs_map_blocks(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		unsigned int *bno, bool *unwritten, bool nowait)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	unsigned int near;
+	bool new;
+	int ret;
+
+	*unwritten = false;
+	if(nowait){
+		if(!down_read_trylock(&pii->i_map_sem))
+			return -EAGAIN;
+	}
+	else
+		down_read(&pii->i_map_sem);
+
+	if(pii->i_flags & PINTFS_EXTENTS_FL)
+		ret = pintfs_ext_map(inode, iblock, maxblocks, bno, unwritten, &near, nowait);
+	else
+		ret = __pintfs_get_blocks(inode, iblock, maxblocks, 0, bno, &new, nowait);
+	up_read(&pii->i_map_sem);
+	return ret;
+}
+
+/*
+   pintfs_block_unwritten - whether file block iblock is preallocated but unwritten
+*/
+static bool pintfs_block_unwritten(struct inode *inode, sector_t iblock)
+{
+	unsigned int block_no;
+	bool unwritten;
+
+	return pintfs_map_blocks(inode, iblock, 1, &block_no, &unwritten, false) > 0 && unwritten;
+}
+
+/*
+   pintfs_free_branch - free what *p maps from relative file block 'start' on
+   depth is the number of indirect levels under *p (0: *p is a data block).
+*/
+static void pintfs_free_branch(struct inode *inode, unsigned int *p, int depth,
+		unsigned long start)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	unsigned int *entries;
+	unsigned long span;
+	int i;
+
+	if(!*p)
+		return;
+
+	if(depth > 0){
+		bh = sb_bread(sb, *p);
 		if(!bh){
-			return -EIO;
+			printk("pintfs - free_branch: unable to read block %u\n", *p);
+			return;
 		}
-		block_read = min((PINTFS_BLOCK_SIZE - offset), bytes_to_read);
-		if(copy_to_user(start + bytes_read, bh->b_data + offset, block_read)){
+		entries = (unsigned int *)bh->b_data;
+		span = depth == 1 ? 1 : PINTFS_ADDR_PER_BLOCK;
+		for(i = start / span; i < PINTFS_ADDR_PER_BLOCK; i++)
+			pintfs_free_branch(inode, &entries[i], depth - 1,
+					i == start / span ? start % span : 0);
+
+		if(start){
+			// map block keeps the head of the file
+			pintfs_dirty_buffer(sb, bh);
 			brelse(bh);
-			return -EIO;
+			return;
 		}
+		bforget(bh);
+	}
+
+	pintfs_free_block(sb, *p);
+	*p = 0;
+}
+
+/*
+   pintfs_free_range - free the data blocks mapped in file blocks [first, end)
+   Map blocks stay, truncate frees them. Block map files only, caller
+   holds i_map_sem exclusively.
+*/
+static void pintfs_free_range(struct inode *inode, unsigned long first, unsigned long end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh, *next;
+	unsigned int *p;
+	int offsets[3], depth, boundary, level, n, i;
+
+	while(first < end){
+		depth = pintfs_block_to_path(first, offsets, &boundary);
+		if(!depth)
+			return;
+		n = min_t(unsigned long, boundary + 1, end - first);
 
+		bh = NULL;
+		p = PINTFS_I(inode)->i_data + offsets[0];
+		for(level = 1; level < depth && *p; level++){
+			next = sb_bread(sb, *p);
+			brelse(bh);
+			bh = next;
+			if(!bh){
+				printk("pintfs - free_range: unable to read map block\n");
+				return;
+			}
+			p = (unsigned int *)bh->b_data + offsets[level];
+		}
+		// a missing map block maps nothing
+		if(level == depth){
+			for(i = 0; i < n; i++){
+				if(!p[i])
+					continue;
+				pintfs_free_block(sb, p[i]);
+				p[i] = 0;
+			}
+			if(bh)
+				pintfs_dirty_buffer(sb, bh);
+			else
+				mark_inode_dirty(inode);
+		}
 		brelse(bh);
-		bytes_read += block_read;
-		*ppos += block_read;
+		first += n;
+	}
+}
 
-		index++;
-		offset = 0;
+/*
+   pintfs_truncate_blocks - free every block at or past byte 'offset'
+*/
+void pintfs_truncate_blocks(struct inode *inode, loff_t offset)
+{
+	unsigned int *i_data = PINTFS_I(inode)->i_data;
+	unsigned long first, apb = PINTFS_ADDR_PER_BLOCK;
+	int i;
+
+	first = (offset + PINTFS_BLOCK_SIZE - 1) >> PINTFS_BLOCK_BITS;
+	down_write(&PINTFS_I(inode)->i_map_sem);
+	if(PINTFS_I(inode)->i_flags & PINTFS_INLINE_DATA_FL){
+		up_write(&PINTFS_I(inode)->i_map_sem);
+		return;
+	}
+	if(PINTFS_I(inode)->i_flags & PINTFS_EXTENTS_FL){
+		pintfs_ext_truncate(inode, first);
+		up_write(&PINTFS_I(inode)->i_map_sem);
+		return;
 	}
-	
-	if (DEBUG)
-		printk("pintfs - read %d bytes\n", bytes_read);
 
-	return bytes_read;
+	for(i = first; i < PINTFS_NDIR_BLOCKS; i++)
+		pintfs_free_branch(inode, &i_data[i], 0, 0);
+
+	first = first > PINTFS_NDIR_BLOCKS ? first - PINTFS_NDIR_BLOCKS : 0;
+	if(first < apb){
+		pintfs_free_branch(inode, &i_data[PINTFS_IND_BLOCK], 1, first);
+		first = 0;
+	}
+	else
+		first -= apb;
+	pintfs_free_branch(inode, &i_data[PINTFS_DIND_BLOCK], 2, first);
+	up_write(&PINTFS_I(inode)->i_map_sem);
+
+	mark_inode_dirty(inode);
 }
+
 /*
-   pintfs_write - write file
+   pintfs_truncate - change file size to 'size', freeing blocks past it
 */
-static ssize_t pintfs_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+int pintfs_truncate(struct inode *inode, loff_t size)
 {
-	struct inode *inode = filp->f_inode;
-	struct super_block *sb;
-	struct buffer_head *bh;
-	int index, offset, bytes_to_write, bytes_written, block_write;
+	int error;
 
 	if(DEBUG)
-		printk("pintfs - file write at ppos=%lld\n",*ppos);
+		printk("pintfs - truncate ino=%ld size=%lld\n", inode->i_ino, size);
 
-	if(!inode)
+	if(!S_ISREG(inode->i_mode))
 		return -EINVAL;
 
-	if(!(S_ISREG(inode->i_mode)))
-		return -EINVAL;
+	// direct I/O in flight may still write into blocks being freed
+	inode_dio_wait(inode);
+	// and a fault must not map a page over them again
+	down_write(&PINTFS_I(inode)->i_mmap_sem);
+	if(pintfs_is_inline(inode)){
+		if(size <= PINTFS_INLINE_DATA_SIZE){
+			// a later extension must read zeros
+			truncate_setsize(inode, size);
+			memset((char *)PINTFS_I(inode)->i_data + size, 0,
+					PINTFS_INLINE_DATA_SIZE - size);
+			goto done;
+		}
+		error = pintfs_inline_convert(inode);
+		if(error)
+			goto out;
+	}
+	error = block_truncate_page(inode->i_mapping, size, pintfs_get_block);
+	if(error)
+		goto out;
+
+	truncate_setsize(inode, size);
+	pintfs_truncate_blocks(inode, size);
+done:
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+out:
+	up_write(&PINTFS_I(inode)->i_mmap_sem);
+	return error;
+}
+
+/*
+   pintfs_delay_run - how many delayed blocks follow iblock in the page cache
+   Only an estimate for sizing the allocation: pages that are busy, clean
+   or not fully delayed end the run.
+*/
+static unsigned int pintfs_delay_run(struct inode *inode, sector_t iblock)
+{
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int per_page = PAGE_SIZE >> inode->i_blkbits;
+	struct buffer_head *head, *bh;
+	struct page *page;
+	unsigned int run = 1;
+	pgoff_t index;
+	bool delayed;
+
+	index = (iblock + per_page) >> (PAGE_SHIFT - inode->i_blkbits);
+	while(run < PINTFS_DELAY_MAX_RUN){
+		page = find_get_page(mapping, index);
+		if(!page)
+			break;
+		if(!trylock_page(page)){
+			put_page(page);
+			break;
+		}
+		delayed = page->mapping == mapping && PageDirty(page) && page_has_buffers(page);
+		if(delayed){
+			bh = head = page_buffers(page);
+			do{
+				if(!buffer_delay(bh))
+					delayed = false;
+				bh = bh->b_this_page;
+			}while(bh != head);
+		}
+		unlock_page(page);
+		put_page(page);
+		if(!delayed)
+			break;
+		run += per_page;
+		index++;
+	}
+	return min_t(unsigned int, run, PINTFS_DELAY_MAX_RUN);
+}
+
+/*
+   pintfs_get_block - map file block 'iblock' to a disk block for the page cache
+   If create is set, alloc a new block for an unmapped index.
+   A delayed buffer reaching writeback gets its block here. The
+   allocation covers the whole delayed run after it, so the pages that
+   follow only look their blocks up; each buffer drops its reservation.
+*/
+int pintfs_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	unsigned int max_blocks = bh_result->b_size >> inode->i_blkbits;
+	unsigned int block_no;
+	bool new, delayed = create && buffer_delay(bh_result);
+	int ret;
 
-	if(*ppos > inode->i_size || count < 0)
+	if(delayed)
+		max_blocks = pintfs_delay_run(inode, iblock);
+
+	ret = pintfs_get_blocks(inode, iblock, max_blocks,
+			delayed ? PINTFS_CREATE_RESERVED : create, &block_no, &new);
+	if(ret < 0)
+		return ret;
+	if(!block_no)
 		return 0;
 
-	sb = inode->i_sb;
-	index = *ppos / PINTFS_BLOCK_SIZE;
-	offset = *ppos % PINTFS_BLOCK_SIZE;
+	map_bh(bh_result, inode->i_sb, block_no);
+	if(delayed){
+		// still one page buffer, the rest of the run is mapped for later pages
+		if(!buffer_unwritten(bh_result))
+			pintfs_release_blocks(inode->i_sb, 1);
+		clear_buffer_unwritten(bh_result);
+		ret = 1;
+	}
+	bh_result->b_size = ret << inode->i_blkbits;
+	if(new)
+		set_buffer_new(bh_result);
+	return 0;
+}
 
-	if (DEBUG)
-		printk("file write - index=%d, offset=%d\n",index, offset);
+/*
+   pintfs_get_block_delay - get_block_t for buffered writes
+   A hole is not allocated: one block is reserved against the free count
+   and the buffer is marked delayed, to be allocated at writeback.
+   An unwritten block is delayed too, so it only turns written along with
+   its data, but it needs no reservation: it is marked unwritten as well.
+*/
+static int pintfs_get_block_delay(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	unsigned int block_no;
+	bool new;
+	int ret;
 
-	bytes_to_write = count;
-	bytes_written = 0;
+	ret = pintfs_get_blocks(inode, iblock, 1, 0, &block_no, &new);
+	if(ret < 0)
+		return ret;
+	if(block_no){
+		map_bh(bh_result, inode->i_sb, block_no);
+		return 0;
+	}
 
-	while(bytes_written < bytes_to_write)
-	{
-		if(pintfs_need_file_extension(inode, index)){
-			if(pintfs_expand_file(inode, index) < 0){
-				printk("w : failed to exted file\n");
-				break;
+	if(pintfs_block_unwritten(inode, iblock))
+		set_buffer_unwritten(bh_result);
+	else{
+		ret = pintfs_reserve_blocks(inode->i_sb, 1);
+		if(ret)
+			return ret;
+	}
+	map_bh(bh_result, inode->i_sb, PINTFS_DELAY_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/*
+   pintfs_inline_fill_page - copy the inline data into page 0, zeroing the rest
+   Caller holds the page lock, and the lock of page 0 guards the inline data.
+*/
+static void pintfs_inline_fill_page(struct inode *inode, struct page *page)
+{
+	size_t len = 0;
+	void *kaddr;
+
+	if(!page->index)
+		len = min_t(loff_t, i_size_read(inode), PINTFS_INLINE_DATA_SIZE);
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, PINTFS_I(inode)->i_data, len);
+	memset(kaddr + len, 0, PAGE_SIZE - len);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr);
+	SetPageUptodate(page);
+}
+
+/*
+   pintfs_inline_convert - move inline data out to a real block
+   The block is delayed like any buffered write, so the only cost here is
+   a reservation. If there is no space the data stays inline.
+*/
+int pintfs_inline_convert(struct inode *inode)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	char data[PINTFS_INLINE_DATA_SIZE];
+	unsigned int len;
+	struct page *page;
+	int ret = 0;
+
+	if(!pintfs_is_inline(inode))
+		return 0;
+
+	page = grab_cache_page_write_begin(inode->i_mapping, 0, 0);
+	if(!page)
+		return -ENOMEM;
+	if(!pintfs_is_inline(inode))
+		goto out;
+
+	if(DEBUG)
+		printk("pintfs - inline_convert ino=%ld size=%lld\n", inode->i_ino, inode->i_size);
+
+	if(!PageUptodate(page))
+		pintfs_inline_fill_page(inode, page);
+
+	down_write(&pii->i_map_sem);
+	memcpy(data, pii->i_data, sizeof(data));
+	memset(pii->i_data, 0, sizeof(pii->i_data));
+	pii->i_flags &= ~PINTFS_INLINE_DATA_FL;
+	if(PINTFS_SB(sb)->s_es->feature_incompat & PINTFS_FEATURE_INCOMPAT_EXTENTS){
+		pii->i_flags |= PINTFS_EXTENTS_FL;
+		pintfs_ext_init(inode);
+	}
+	up_write(&pii->i_map_sem);
+
+	len = i_size_read(inode);
+	if(len){
+		ret = __block_write_begin(page, 0, len, pintfs_get_block_delay);
+		if(ret){
+			down_write(&pii->i_map_sem);
+			memcpy(pii->i_data, data, sizeof(data));
+			pii->i_flags &= ~PINTFS_EXTENTS_FL;
+			pii->i_flags |= PINTFS_INLINE_DATA_FL;
+			up_write(&pii->i_map_sem);
+			goto out;
+		}
+		block_commit_write(page, 0, len);
+	}
+	mark_inode_dirty(inode);
+out:
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+static int pintfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+
+	if(pintfs_is_inline(inode)){
+		// the inode table read already brought the data in
+		pintfs_inline_fill_page(inode, page);
+		unlock_page(page);
+		return 0;
+	}
+	return mpage_readpage(page, pintfs_get_block);
+}
+
+static void pintfs_readahead(struct readahead_control *rac)
+{
+	// pages left unread here go through readpage
+	if(pintfs_is_inline(rac->mapping->host))
+		return;
+	mpage_readahead(rac, pintfs_get_block);
+}
+
+static int pintfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	return block_write_full_page(page, pintfs_get_block, wbc);
+}
+
+/*
+   pintfs_writepages - mpage would send delayed buffers to their fake
+   block, so go page by page; the plug still merges adjacent blocks
+*/
+static int pintfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	return generic_writepages(mapping, wbc);
+}
+
+/*
+   pintfs_invalidatepage - give back the reservations of delayed buffers
+   that will never be written
+*/
+static void pintfs_invalidatepage(struct page *page, unsigned int offset,
+		unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *head, *bh;
+	unsigned int start = 0, end, stop = offset + length, released = 0;
+
+	if(page_has_buffers(page)){
+		bh = head = page_buffers(page);
+		do{
+			end = start + bh->b_size;
+			if(start >= offset && end <= stop && buffer_delay(bh)){
+				if(!buffer_unwritten(bh))
+					released++;
+				clear_buffer_delay(bh);
+				clear_buffer_unwritten(bh);
 			}
+			start = end;
+			bh = bh->b_this_page;
+		}while(bh != head);
+	}
+	if(released)
+		pintfs_release_blocks(inode->i_sb, released);
+
+	block_invalidatepage(page, offset, length);
+}
+
+/*
+   pintfs_write_failed - drop pages instantiated beyond i_size by a failed write
+*/
+static void pintfs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	if(to > inode->i_size){
+		truncate_pagecache(inode, inode->i_size);
+		pintfs_truncate_blocks(inode, inode->i_size);
+	}
+}
+
+static int pintfs_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int ret;
+
+	if(DEBUG)
+		printk("pintfs - write_begin pos=%lld len=%u\n", pos, len);
+
+	if(pintfs_is_inline(inode)){
+		if(pos + len > PINTFS_INLINE_DATA_SIZE){
+			ret = pintfs_inline_convert(inode);
+			if(ret)
+				return ret;
 		}
-		bh = pintfs_sb_bread_file(inode, index);
-		if(!bh)
-			return -EIO;
+		else{
+			page = grab_cache_page_write_begin(mapping, 0, flags);
+			if(!page)
+				return -ENOMEM;
+			// recheck under the page lock, page_mkwrite may have converted
+			if(pintfs_is_inline(inode)){
+				if(!PageUptodate(page))
+					pintfs_inline_fill_page(inode, page);
+				*pagep = page;
+				return 0;
+			}
+			unlock_page(page);
+			put_page(page);
+		}
+	}
 
-		block_write = min(PINTFS_BLOCK_SIZE - offset, bytes_to_write);
-		if(copy_from_user(bh->b_data + offset, buf + bytes_written, block_write)){
-			brelse(bh);
-			return -EIO;
+	ret = block_write_begin(mapping, pos, len, flags, pagep, pintfs_get_block_delay);
+	if(ret < 0)
+		pintfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+/*
+   pintfs_inline_write_end - copy what was written to page 0 into the inode
+   The page is never dirtied, inode writeback carries the data.
+*/
+static int pintfs_inline_write_end(struct inode *inode, loff_t pos, unsigned copied,
+		struct page *page)
+{
+	void *kaddr;
+
+	kaddr = kmap_atomic(page);
+	memcpy((char *)PINTFS_I(inode)->i_data + pos, kaddr + pos, copied);
+	kunmap_atomic(kaddr);
+	if(pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	unlock_page(page);
+	put_page(page);
+
+	mark_inode_dirty(inode);
+	return copied;
+}
+
+static int pintfs_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	int ret;
+
+	// inline state only changes under the lock of page 0, which we hold
+	if(pintfs_is_inline(mapping->host))
+		return pintfs_inline_write_end(mapping->host, pos, copied, page);
+
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if(ret < len)
+		pintfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+/*
+   pintfs_fsync - flush file data and the metadata buffers it dirtied
+   The inode only reaches its table block at writeback, so copy it there
+   first. Bitmaps and inode table blocks are only marked dirty, so push
+   the block device buffers out before the cache flush.
+*/
+int pintfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	int ret;
+
+	if(DEBUG)
+		printk("pintfs - fsync\n");
+
+	ret = file_write_and_wait_range(file, start, end);
+	if(ret)
+		return ret;
+
+	ret = sync_inode_metadata(inode, 0);
+	if(ret)
+		return ret;
+
+	ret = sync_blockdev(sb->s_bdev);
+	if(ret)
+		return ret;
+
+	return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+}
+
+/*
+   pintfs_zero_partial - zero bytes [from, to) of one block through the page cache
+   Holes and unwritten blocks already read as zeros, so only a written
+   block is dirtied.
+*/
+static int pintfs_zero_partial(struct inode *inode, loff_t from, loff_t to)
+{
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int block_no;
+	struct page *page;
+	void *fsdata;
+	bool new;
+	int ret;
+
+	to = min_t(loff_t, to, i_size_read(inode));
+	if(from >= to)
+		return 0;
+
+	ret = pintfs_get_blocks(inode, from >> inode->i_blkbits, 1, 0, &block_no, &new);
+	if(ret < 0 || !block_no)
+		return ret < 0 ? ret : 0;
+
+	ret = pagecache_write_begin(NULL, mapping, from, to - from, 0, &page, &fsdata);
+	if(ret)
+		return ret;
+	zero_user(page, offset_in_page(from), to - from);
+	ret = pagecache_write_end(NULL, mapping, from, to - from, to - from, page, fsdata);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+   pintfs_punch_hole - free the blocks of [offset, offset+len), keeping i_size
+*/
+static int pintfs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	unsigned int blocksize = i_blocksize(inode);
+	loff_t end = offset + len, first, last;
+	int ret;
+
+	inode_dio_wait(inode);
+	down_write(&PINTFS_I(inode)->i_mmap_sem);
+	truncate_pagecache_range(inode, offset, end - 1);
+
+	first = round_up(offset, blocksize);
+	last = round_down(end, blocksize);
+	if(first > last){
+		// inside one block
+		ret = pintfs_zero_partial(inode, offset, end);
+		goto out;
+	}
+	ret = pintfs_zero_partial(inode, offset, first);
+	if(!ret)
+		ret = pintfs_zero_partial(inode, last, end);
+	if(ret || first == last)
+		goto out;
+
+	down_write(&PINTFS_I(inode)->i_map_sem);
+	ret = pintfs_ext_punch(inode, first >> inode->i_blkbits, last >> inode->i_blkbits);
+	up_write(&PINTFS_I(inode)->i_map_sem);
+out:
+	up_write(&PINTFS_I(inode)->i_mmap_sem);
+	return ret;
+}
+
+/*
+   pintfs_set_unwritten_feature - called before the first unwritten extent is made
+   Older drivers must not read unwritten extents as data.
+*/
+static void pintfs_set_unwritten_feature(struct super_block *sb)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+
+	if(sbi->s_es->feature_incompat & PINTFS_FEATURE_INCOMPAT_UNWRITTEN)
+		return;
+	lock_buffer(sbi->s_sbh);
+	sbi->s_es->feature_incompat |= PINTFS_FEATURE_INCOMPAT_UNWRITTEN;
+	unlock_buffer(sbi->s_sbh);
+	pintfs_dirty_buffer(sb, sbi->s_sbh);
+}
+
+/*
+   pintfs_fallocate - preallocate or punch out file blocks
+   Preallocated blocks are unwritten extents, so the device is never zeroed;
+   they turn written when writeback first maps them. Block map files have
+   no room for that state and only get -EOPNOTSUPP.
+*/
+static long pintfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	loff_t end = offset + len;
+	int ret;
+
+	if(DEBUG)
+		printk("pintfs - fallocate ino=%ld mode=%x off=%lld len=%lld\n",
+				inode->i_ino, mode, offset, len);
+
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+	if(!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	ret = pintfs_inline_convert(inode);
+	if(ret)
+		goto unlock;
+	if(!(PINTFS_I(inode)->i_flags & PINTFS_EXTENTS_FL)){
+		ret = -EOPNOTSUPP;
+		goto unlock;
+	}
+
+	if(mode & FALLOC_FL_PUNCH_HOLE){
+		ret = pintfs_punch_hole(inode, offset, len);
+		goto out;
+	}
+
+	if(!(mode & FALLOC_FL_KEEP_SIZE)){
+		ret = inode_newsize_ok(inode, end);
+		if(ret)
+			goto out;
+	}
+
+	pintfs_set_unwritten_feature(inode->i_sb);
+	down_write(&PINTFS_I(inode)->i_map_sem);
+	ret = pintfs_ext_prealloc(inode, offset >> inode->i_blkbits,
+			((end - 1) >> inode->i_blkbits) - (offset >> inode->i_blkbits) + 1);
+	up_write(&PINTFS_I(inode)->i_map_sem);
+	if(ret)
+		goto out;
+
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+out:
+	if(!ret){
+		inode->i_ctime = current_time(inode);
+		if(mode & FALLOC_FL_PUNCH_HOLE)
+			inode->i_mtime = inode->i_ctime;
+		mark_inode_dirty(inode);
+	}
+unlock:
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+   pintfs_seek_pagecache - search [start, end) of a hole for dirty pages
+   Delayed and unwritten blocks only hold data in the page cache.
+   Return the first byte of a dirty page (data) or of a clean or missing
+   one (!data), end if there is none.
+*/
+static loff_t pintfs_seek_pagecache(struct inode *inode, loff_t start, loff_t end, bool data)
+{
+	pgoff_t index = start >> PAGE_SHIFT, last = (end - 1) >> PAGE_SHIFT, expect = index;
+	struct pagevec pvec;
+	struct page *page;
+	loff_t ret = end;
+	unsigned int i, nr;
+
+	pagevec_init(&pvec);
+	while(index <= last){
+		nr = pagevec_lookup_range(&pvec, inode->i_mapping, &index, last);
+		if(!nr)
+			break;
+		for(i = 0; i < nr; i++){
+			page = pvec.pages[i];
+			if(!data && page->index != expect)
+				break;
+			if((PageDirty(page) || PageWriteback(page)) == data)
+				break;
+			expect = page->index + 1;
+		}
+		if(i < nr){
+			ret = data ? (loff_t)page->index << PAGE_SHIFT : (loff_t)expect << PAGE_SHIFT;
+			pagevec_release(&pvec);
+			goto out;
 		}
+		pagevec_release(&pvec);
+	}
+	if(!data && expect <= last)
+		ret = (loff_t)expect << PAGE_SHIFT;
+out:
+	return clamp(ret, start, end);
+}
 
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-		brelse(bh);
+/*
+   pintfs_iomap_inline - report inline data for fiemap and seek
+   Direct I/O never gets here: reads fall back to the page cache and
+   writes convert the inode first.
+*/
+static int pintfs_iomap_inline(struct inode *inode, loff_t offset, loff_t length,
+		unsigned flags, struct iomap *iomap)
+{
+	struct super_block *sb = inode->i_sb;
+	loff_t size = i_size_read(inode);
+	unsigned long ino = inode->i_ino;
 
-		*ppos += block_write;
-		bytes_written += block_write;
+	if(flags & IOMAP_WRITE)
+		return -EIO;
 
-		if(*ppos > inode->i_size)
-			inode->i_size = *ppos;
-		
-		index++;
-		offset = 0;
+	iomap->flags = 0;
+	iomap->bdev = sb->s_bdev;
+	if(offset >= size){
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = offset;
+		iomap->length = length;
+		return 0;
 	}
 
-	pintfs_write_inode(inode->i_sb, inode);
-	if (DEBUG)
-		printk("pintfs - write %d bytes\n", bytes_written);
-	return bytes_written;
+	iomap->type = IOMAP_INLINE;
+	iomap->inline_data = PINTFS_I(inode)->i_data;
+	iomap->offset = 0;
+	iomap->length = size;
+	// where the bytes sit on disk, inside the inode table
+	iomap->addr = ((u64)pintfs_inode_block(sb, ino) << sb->s_blocksize_bits) +
+		(ino - 1) % PINTFS_SB(sb)->s_inodes_per_group % PINTFS_INODES_PER_BLOCK *
+		PINTFS_INODE_SIZE + offsetof(struct pintfs_inode, i_block);
+	return 0;
 }
 
 /*
-   FILE_OPERATIONS
+   pintfs_iomap_begin - report the mapping at offset as one multi-block run
+   A direct write fills a hole in one allocation. In an extent file the
+   new blocks are unwritten, like ones it finds, until end_io sees its
+   data on disk, so nothing reads their stale contents meanwhile. A block
+   map file has no unwritten state: a hole inside i_size gets -ENOTBLK
+   and is written through the page cache instead.
+   Reports (fiemap, seek) split holes by the page cache, where delayed
+   blocks live.
+   IOMAP_NOWAIT gets -EAGAIN for anything that would allocate, wait
+   on i_map_sem or read a map block from disk.
 */
-const struct file_operations pintfs_file_ops = {
-	.read = pintfs_read,
-	.write = pintfs_write,
+static int pintfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+		unsigned flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	unsigned int bits = inode->i_blkbits, block_no, max, hole;
+	sector_t first = offset >> bits;
+	bool unwritten, new = false;
+	loff_t start, end, pos;
+	int ret;
+
+	if(pintfs_is_inline(inode))
+		return pintfs_iomap_inline(inode, offset, length, flags, iomap);
+
+	max = min_t(u64, ((offset + length - 1) >> bits) - first + 1, UINT_MAX);
+	ret = pintfs_map_blocks(inode, first, max, &block_no, &unwritten, flags & IOMAP_NOWAIT);
+	if(ret >= 0 && !block_no && (flags & IOMAP_WRITE)){
+		// allocating may sleep on bitmaps and the group mutex
+		if(flags & IOMAP_NOWAIT)
+			return -EAGAIN;
+		if(!(pii->i_flags & PINTFS_EXTENTS_FL) && offset < i_size_read(inode))
+			return -ENOTBLK;
+		if(pii->i_flags & PINTFS_EXTENTS_FL){
+			hole = ret;
+			pintfs_set_unwritten_feature(inode->i_sb);
+			down_write(&pii->i_map_sem);
+			ret = pintfs_ext_prealloc(inode, first, hole);
+			up_write(&pii->i_map_sem);
+			if(!ret)
+				ret = pintfs_map_blocks(inode, first, hole, &block_no, &unwritten, false);
+			new = true;
+		}
+		else
+			ret = pintfs_get_blocks(inode, first, max, 1, &block_no, &new);
+	}
+	if(ret < 0)
+		return ret;
+
+	iomap->flags = new ? IOMAP_F_NEW : 0;
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)first << bits;
+	iomap->length = (loff_t)ret << bits;
+	if(block_no){
+		iomap->type = unwritten ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		iomap->addr = (u64)block_no << bits;
+		return 0;
+	}
+
+	iomap->type = IOMAP_HOLE;
+	iomap->addr = IOMAP_NULL_ADDR;
+	if(flags & IOMAP_REPORT){
+		start = iomap->offset;
+		end = start + iomap->length;
+		pos = pintfs_seek_pagecache(inode, start, end, true);
+		if(pos == start){
+			iomap->type = IOMAP_DELALLOC;
+			pos = pintfs_seek_pagecache(inode, start, end, false);
+		}
+		iomap->length = pos - start;
+	}
+	return 0;
+}
+
+/*
+   pintfs_iomap_end - drop blocks a short direct write allocated past i_size
+   i_size only moves in end_io, so everything up to offset + written,
+   earlier iterations included, is still in flight and must stay. Only
+   this mapping's new blocks go; preallocation further out is kept.
+*/
+static int pintfs_iomap_end(struct inode *inode, loff_t offset, loff_t length,
+		ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	unsigned int bits = inode->i_blkbits;
+	loff_t from, end;
+
+	if(!(flags & IOMAP_WRITE) || !(iomap->flags & IOMAP_F_NEW) || written >= length)
+		return 0;
+
+	from = round_up(offset + max_t(ssize_t, written, 0), i_blocksize(inode));
+	end = min(round_up(offset + length, i_blocksize(inode)), iomap->offset + iomap->length);
+	if(from < i_size_read(inode) || from >= end)
+		return 0;
+
+	down_write(&pii->i_map_sem);
+	if(pii->i_flags & PINTFS_EXTENTS_FL)
+		pintfs_ext_punch(inode, from >> bits, end >> bits);
+	else
+		pintfs_free_range(inode, from >> bits, end >> bits);
+	up_write(&pii->i_map_sem);
+	return 0;
+}
+
+static const struct iomap_ops pintfs_iomap_ops = {
+	.iomap_begin	= pintfs_iomap_begin,
+	.iomap_end	= pintfs_iomap_end,
+};
+
+static sector_t pintfs_bmap(struct address_space *mapping, sector_t block)
+{
+	// iomap_bmap writes delayed blocks back first
+	return iomap_bmap(mapping, block, &pintfs_iomap_ops);
+}
+
+/*
+   pintfs_dio_write_end_io - turn unwritten blocks written once the data is
+   on disk, then move i_size
+*/
+static int pintfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+		unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int bits = inode->i_blkbits, block_no;
+	loff_t pos = iocb->ki_pos;
+	sector_t blk, last;
+	bool new;
+	int ret;
+
+	if(error || !size)
+		return error;
+
+	if(flags & IOMAP_DIO_UNWRITTEN){
+		blk = pos >> bits;
+		last = (pos + size - 1) >> bits;
+		while(blk <= last){
+			ret = pintfs_get_blocks(inode, blk, min_t(sector_t, last - blk + 1, UINT_MAX),
+					1, &block_no, &new);
+			if(ret < 0)
+				return ret;
+			blk += ret;
+		}
+	}
+
+	if(pos + size > i_size_read(inode)){
+		i_size_write(inode, pos + size);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops pintfs_dio_write_ops = {
+	.end_io		= pintfs_dio_write_end_io,
+};
+
+/*
+   pintfs_file_read_iter - O_DIRECT reads go to iomap, the rest to the page cache
+*/
+static ssize_t pintfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	// inline data is only a few bytes in the inode, not worth a bio
+	if(pintfs_is_inline(inode))
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	if(!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+	if(!iov_iter_count(to))
+		return 0;
+
+	if(iocb->ki_flags & IOCB_NOWAIT){
+		if(!inode_trylock_shared(inode))
+			return -EAGAIN;
+	}
+	else
+		inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &pintfs_iomap_ops, NULL, is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+/*
+   pintfs_dio_write_iter - O_DIRECT write through iomap
+   i_size only moves at completion, so a write past it completes in line;
+   anything else completes asynchronously for AIO and io_uring.
+   Whatever iomap leaves with -ENOTBLK (page cache that can't be dropped,
+   a block map hole inside i_size) is written buffered and flushed.
+   IOCB_NOWAIT gets -EAGAIN wherever we would block.
+*/
+static ssize_t pintfs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	loff_t pos;
+	ssize_t ret, written;
+	bool extend;
+
+	if(iocb->ki_flags & IOCB_NOWAIT){
+		if(!inode_trylock(inode))
+			return -EAGAIN;
+	}
+	else
+		inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if(ret <= 0)
+		goto out;
+	// dropping suid bits dirties the inode and may sleep
+	ret = -EAGAIN;
+	if((iocb->ki_flags & IOCB_NOWAIT) && !IS_NOSEC(inode))
+		goto out;
+	ret = file_remove_privs(file);
+	if(ret)
+		goto out;
+	ret = file_update_time(file);
+	if(ret)
+		goto out;
+	if(pintfs_is_inline(inode)){
+		ret = -EAGAIN;
+		if(iocb->ki_flags & IOCB_NOWAIT)
+			goto out;
+		ret = pintfs_inline_convert(inode);
+		if(ret)
+			goto out;
+	}
+
+	extend = iocb->ki_pos + iov_iter_count(from) > i_size_read(inode);
+	ret = iomap_dio_rw(iocb, from, &pintfs_iomap_ops, &pintfs_dio_write_ops,
+			is_sync_kiocb(iocb) || extend);
+	// -ENOTBLK stops the direct write early (page cache busy or a block
+	// map hole), the rest goes through the page cache
+	if(ret == -ENOTBLK)
+		ret = 0;
+	if(ret < 0 || !iov_iter_count(from))
+		goto out;
+	if(iocb->ki_flags & IOCB_NOWAIT){
+		if(!ret)
+			ret = -EAGAIN;
+		goto out;
+	}
+	pos = iocb->ki_pos;
+	written = generic_perform_write(file, from, pos);
+	if(written > 0){
+		iocb->ki_pos += written;
+		if(!filemap_write_and_wait_range(file->f_mapping, pos, pos + written - 1))
+			invalidate_mapping_pages(file->f_mapping, pos >> PAGE_SHIFT,
+					(pos + written - 1) >> PAGE_SHIFT);
+		ret += written;
+	}
+	else if(!ret)
+		ret = written;
+out:
+	inode_unlock(inode);
+	if(ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static ssize_t pintfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	if(iocb->ki_flags & IOCB_DIRECT)
+		return pintfs_dio_write_iter(iocb, from);
+	return generic_file_write_iter(iocb, from);
+}
+
+/*
+   pintfs_file_open - direct I/O can honour IOCB_NOWAIT, so say so
+*/
+static int pintfs_file_open(struct inode *inode, struct file *file)
+{
+	file->f_mode |= FMODE_NOWAIT;
+	return generic_file_open(inode, file);
+}
+
+/*
+   pintfs_llseek - generic llseek plus SEEK_HOLE/SEEK_DATA through iomap
+*/
+static loff_t pintfs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	switch(whence){
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &pintfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &pintfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+	if(offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+   pintfs_filemap_fault - read fault, kept out of ranges being truncated or punched
+*/
+static vm_fault_t pintfs_filemap_fault(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	down_read(&PINTFS_I(inode)->i_mmap_sem);
+	ret = filemap_fault(vmf);
+	up_read(&PINTFS_I(inode)->i_mmap_sem);
+	return ret;
+}
+
+/*
+   pintfs_page_mkwrite - first write to a mapped page
+   Holes get a delayed block like a buffered write, so the store itself
+   only reserves space; writeback allocates.
+*/
+static vm_fault_t pintfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+	int err;
+
+	if(DEBUG)
+		printk("pintfs - page_mkwrite ino=%ld index=%lu\n", inode->i_ino, vmf->pgoff);
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	down_read(&PINTFS_I(inode)->i_mmap_sem);
+	// stores through the mapping can't be seen by write_end, so leave inline
+	err = pintfs_inline_convert(inode);
+	if(!err)
+		err = block_page_mkwrite(vmf->vma, vmf, pintfs_get_block_delay);
+	ret = block_page_mkwrite_return(err);
+	up_read(&PINTFS_I(inode)->i_mmap_sem);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct pintfs_file_vm_ops = {
+	.fault		= pintfs_filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= pintfs_page_mkwrite,
 };
 
+static int pintfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &pintfs_file_vm_ops;
+	return 0;
+}
+
+/*
+   pintfs_fiemap - report extents, delayed ones included
+*/
+int pintfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	int ret;
+
+	inode_lock_shared(inode);
+	ret = iomap_fiemap(inode, fieinfo, start, len, &pintfs_iomap_ops);
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+/*
+   ADDRESS_SPACE_OPERATIONS
+*/
+const struct address_space_operations pintfs_aops = {
+	.set_page_dirty		= __set_page_dirty_buffers,
+	.readpage		= pintfs_readpage,
+	.readahead		= pintfs_readahead,
+	.writepage		= pintfs_writepage,
+	.writepages		= pintfs_writepages,
+	.invalidatepage		= pintfs_invalidatepage,
+	.write_begin		= pintfs_write_begin,
+	.write_end		= pintfs_write_end,
+	.bmap			= pintfs_bmap,
+	.direct_IO		= noop_direct_IO,
+	.migratepage		= buffer_migrate_page,
+	.is_partially_uptodate	= block_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
 
+/*
+   FILE_OPERATIONS
+*/
+const struct file_operations pintfs_file_ops = {
+	.llseek		= pintfs_llseek,
+	.read_iter	= pintfs_file_read_iter,
+	.write_iter	= pintfs_file_write_iter,
+	.mmap		= pintfs_file_mmap,
+	.open		= pintfs_file_open,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.fsync		= pintfs_fsync,
+	.fallocate	= pintfs_fallocate,
+};
@@ -8,119 +8,257 @@
 #include <linux/stat.h>
 #include <linux/time64.h>
 #include <linux/module.h>
+#include <linux/writeback.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
 #include "pintfs.h"
 #define DEBUG 1
 
 static struct pintfs_inode *pintfs_get_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh);
 
 /*
-	pintfs_write_inode - Write pintfs_inode in block device
+	__pintfs_write_inode - Copy the in-core inode into its inode table block
+	The buffer is only marked dirty, so inodes sharing a table block go out
+	in one write. do_sync waits for that write.
 */
-int pintfs_write_inode(struct super_block *sb, struct inode* inode)
+static int __pintfs_write_inode(struct inode *inode, int do_sync)
 {
 	struct buffer_head *bh;
-	struct pintfs_inode pinode;
+	struct pintfs_inode *pinode;
 	struct pintfs_inode_info *pii = PINTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
 	int inum = inode->i_ino;
+	int err = 0;
+
 	if(DEBUG)
-		printk("pintfs - write_inode in block device (inum:%d)\n", inum);
+		printk("pintfs - write_inode in block device (inum:%d, sync:%d)\n", inum, do_sync);
 
-	pinode.i_mode = inode->i_mode;
-	pinode.i_uid = from_kuid(&init_user_ns, inode->i_uid);  // 변환 후 저장
-	pinode.i_size = inode->i_size;
-	pinode.i_time = inode->i_atime.tv_sec;
-	memcpy(pinode.i_block, pii->i_data, PINTFS_N_BLOCKS);
-	pinode.i_blocks = inode->i_blocks;
+	pinode = pintfs_get_inode(sb, inum, &bh);
+	if(IS_ERR(pinode))
+		return PTR_ERR(pinode);
+
+	pinode->i_mode = inode->i_mode;
+	pinode->i_uid = from_kuid(&init_user_ns, inode->i_uid);  // 변환 후 저장
+	pinode->i_size = inode->i_size;
+	pinode->i_time = inode->i_atime.tv_sec;
+	memcpy(pinode->i_block, pii->i_data, sizeof(pinode->i_block));
+	pinode->i_blocks = inode->i_blocks;
+	pinode->i_flags = pii->i_flags;
 
-	print_pintfs_inode(&pinode);
-	bh = sb_bread(sb, pintfs_get_blocknum(inum));
-	if(!bh)
-		return -ENOSPC;
-	memcpy(bh->b_data + (inum - 1)*sizeof(struct pintfs_inode), &pinode, sizeof(struct pintfs_inode));
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	if(do_sync){
+		sync_dirty_buffer(bh);
+		if(buffer_req(bh) && !buffer_uptodate(bh)){
+			printk("pintfs - IO error syncing inode %d\n", inum);
+			err = -EIO;
+		}
+	}
 	brelse(bh);
+	return err;
+}
 
-	print_pintfs_inode(pintfs_get_inode(sb, inum, &bh));
-	brelse(bh);
+/*
+	pintfs_write_inode - super_operations hook, called by inode writeback
+*/
+int pintfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	return __pintfs_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+}
 
-	if(DEBUG)
-		printk("pintfs - write_inode done (inum=%d)\n", inum);
-	return PINTFS_INODE_SIZE;	
+/*
+	pintfs_dirty_inode - write through on sync mounts, otherwise leave it to writeback
+*/
+void pintfs_dirty_inode(struct inode *inode, int flags)
+{
+	if(!(flags & I_DIRTY_INODE) || !IS_SYNC(inode))
+		return;
+	__pintfs_write_inode(inode, 1);
 }
 
 /*
-   pintfs_empty_inode - Find usable inode number
+   pintfs_find_group - pick the group a new inode should go to
+   Files go to the group of their directory. Directories start at a
+   group picked by the CPU and take one with at least an average share
+   of free inodes, so parallel mkdir spreads over groups and their locks.
 */
-int pintfs_empty_inode(struct super_block *sb)
+static int pintfs_find_group(const struct inode *dir, umode_t mode)
 {
-	struct pintfs_sb_info *sbi;
-	struct pintfs_super_block *psb;
-	struct buffer_head *bh;
-	int inode_bitmap_bno; /* inode bitmap block number */
-	char inode_bitmap[PINTFS_INODE_BITMAP_SIZE];
-	int result = -1, i;
+	struct super_block *sb = dir->i_sb;
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct buffer_head *gdbh;
+	unsigned int ngroups = sbi->s_groups_count;
+	unsigned int start, group, i, min_free = 1;
+
+	if(S_ISDIR(mode)){
+		start = raw_smp_processor_id() % ngroups;
+		min_free = percpu_counter_read_positive(&sbi->s_freeinodes_counter) / ngroups;
+		if(!min_free)
+			min_free = 1;
+	}
+	else
+		start = pintfs_ino_group(sb, dir->i_ino);
+
+	for(i = 0; i < ngroups; i++){
+		group = (start + i) % ngroups;
+		desc = pintfs_get_group_desc(sb, group, &gdbh);
+		if(desc && desc->bg_free_inodes_count >= min_free)
+			return group;
+	}
+	if(min_free == 1)
+		return -1;
+
+	for(i = 0; i < ngroups; i++){
+		group = (start + i) % ngroups;
+		desc = pintfs_get_group_desc(sb, group, &gdbh);
+		if(desc && desc->bg_free_inodes_count)
+			return group;
+	}
+	return -1;
+}
+
+/*
+   pintfs_empty_inode - Find usable inode number and mark it used
+*/
+int pintfs_empty_inode(const struct inode *dir, umode_t mode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct pintfs_group_info *gi;
+	struct buffer_head *bh, *gdbh;
+	unsigned int group, i;
+	int start, bit;
 	
 	if(DEBUG)
 		printk("pintfs - empty_inode\n");
 
-	sbi = PINTFS_SB(sb);
-
-	if(!sbi)
-		return result;
+	start = pintfs_find_group(dir, mode);
+	if(start < 0)
+		return -1;
+
+	// the group may fill up before we lock it, then move on
+	for(i = 0; i < sbi->s_groups_count; i++){
+		group = (start + i) % sbi->s_groups_count;
+		desc = pintfs_get_group_desc(sb, group, &gdbh);
+		if(!desc || !desc->bg_free_inodes_count)
+			continue;
+
+		bh = pintfs_read_inode_bitmap(sb, group, desc);
+		if(!bh)
+			return -1;
+
+		gi = &sbi->s_group_info[group];
+		spin_lock(pintfs_group_lock(sbi, group));
+		bit = pintfs_find_free_bit(bh->b_data, 0, sbi->s_inodes_per_group,
+				gi->gi_inode_hint);
+		if(bit >= 0){
+			__set_bit_le(bit, bh->b_data);
+			desc->bg_free_inodes_count--;
+			gi->gi_inode_hint = bit + 1;
+		}
+		spin_unlock(pintfs_group_lock(sbi, group));
+
+		if(bit >= 0){
+			percpu_counter_dec(&sbi->s_freeinodes_counter);
+			pintfs_dirty_buffer(sb, bh);
+			pintfs_dirty_buffer(sb, gdbh);
+			if(DEBUG)
+				printk("pintfs - find empty ino: return (ino=%u)\n",
+						group * sbi->s_inodes_per_group + bit + 1);
+			return group * sbi->s_inodes_per_group + bit + 1;
+		}
+	}
+	return -1;
+}
 
-	psb = sbi->s_es;
-	inode_bitmap_bno = psb->inode_bitmap_block;
+/*
+   pintfs_free_ino - give inode number 'ino' back to the bitmap of its group
+*/
+void pintfs_free_ino(struct super_block *sb, unsigned long ino)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct buffer_head *bh, *gdbh;
+	unsigned int group, bit;
+	int was_used;
+
+	if(ino < PINTFS_GOOD_FIRST_INO || ino > sbi->s_es->inodes_count){
+		printk("pintfs - free_ino: bad inode number %lu\n", ino);
+		return;
+	}
 
-	bh = sb_bread(sb, inode_bitmap_bno);
+	group = pintfs_ino_group(sb, ino);
+	bit = (ino - 1) % sbi->s_inodes_per_group;
+	desc = pintfs_get_group_desc(sb, group, &gdbh);
+	if(!desc)
+		return;
+	bh = pintfs_read_inode_bitmap(sb, group, desc);
 	if(!bh)
-		return result;
-
-	memcpy(inode_bitmap, bh->b_data, PINTFS_INODE_BITMAP_SIZE);	
-	for(i=PINTFS_GOOD_FIRST_INO; i<PINTFS_INODE_BITMAP_SIZE; i++){
-		if(inode_bitmap[i] == 0){
-			bh->b_data[i] = 1;
-			mark_buffer_dirty(bh);
-			sync_dirty_buffer(bh);
-			result = i;
-			break;
-		}
+		return;
+
+	spin_lock(pintfs_group_lock(sbi, group));
+	was_used = __test_and_clear_bit_le(bit, bh->b_data);
+	if(was_used)
+		desc->bg_free_inodes_count++;
+	spin_unlock(pintfs_group_lock(sbi, group));
+
+	if(was_used){
+		percpu_counter_inc(&sbi->s_freeinodes_counter);
+		pintfs_dirty_buffer(sb, bh);
+		pintfs_dirty_buffer(sb, gdbh);
 	}
-	
-	brelse(bh);
-	if(DEBUG)
-		printk("pintfs - find empty ino: return (ino=%d)\n",result); 
-	return result;
+	else
+		printk("pintfs - free_ino: inode %lu already free\n", ino);
 }
 
 /*
-   pintfs_evict_inode - It is useless now..(11.03)
+   pintfs_evict_inode - last reference is gone; free the inode if it was unlinked
+   Writeback is done with the inode by now, so its number can't be
+   reused while a flusher still writes the old inode over the new one.
 */
 void pintfs_evict_inode(struct inode *inode)
 {
-	struct pintfs_inode_info *pii;
-	struct super_block *sb;
-	int ino, i;
+	bool want_delete = !inode->i_nlink && !is_bad_inode(inode);
 
 	if (DEBUG)
-		printk("pintfs - evict_inode: ino=%ld\n",inode->i_ino);
+		printk("pintfs - evict_inode: ino=%ld nlink=%u\n", inode->i_ino, inode->i_nlink);
 
-	pii = PINTFS_I(inode);
-	ino = inode->i_ino;
-	sb = inode->i_sb;
-
-	for(i=0; i<PINTFS_N_BLOCKS; i++)
-	{
-		// do nothing.. 
-		i += 1;
-		i -= 1;
+	// drops delayed buffers and their reservations too
+	truncate_inode_pages_final(&inode->i_data);
+	if(want_delete){
+		inode->i_size = 0;
+		pintfs_truncate_blocks(inode, 0);
 	}
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
 
-	pintfs_write_inode(sb, inode);
-    //truncate_inode_pages_final(&inode->i_data);
-    //clear_inode(inode);
-	//mark_inode_dirty(inode);
-	return;	
+	if(want_delete)
+		pintfs_free_ino(inode->i_sb, inode->i_ino);
+}
+
+/*
+	pintfs_first_goal - where the first block of a new inode should go
+	A file starts next to its parent directory's block, shifted by a
+	per-process colour so files written in parallel don't interleave.
+	A directory starts in its own group, which pintfs_find_group spread.
+*/
+static unsigned int pintfs_first_goal(const struct inode *dir, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned int group, first, blocks, goal;
+
+	goal = PINTFS_I(dir)->i_data[0];
+	if(S_ISDIR(inode->i_mode) || !goal)
+		return pintfs_group_first_block(sb, pintfs_ino_group(sb, inode->i_ino));
+
+	group = (goal - PINTFS_SB(sb)->s_es->first_data_block) / PINTFS_SB(sb)->s_blocks_per_group;
+	first = pintfs_group_first_block(sb, group);
+	blocks = pintfs_group_blocks(sb, group);
+	goal += (current->pid % 16) * (blocks / 16);
+	if(goal >= first + blocks)
+		goal -= blocks;
+	return goal;
 }
 
 /*
@@ -130,6 +268,7 @@ struct inode *pintfs_new_inode(const struct inode *dir, umode_t mode)
 {
 	struct super_block *sb;
 	struct inode *inode;
+	struct pintfs_inode_info *pii;
 	int new_ino;
 	struct timespec64 cur_time;
 
@@ -144,14 +283,14 @@ struct inode *pintfs_new_inode(const struct inode *dir, umode_t mode)
 	if(!inode)
 		return NULL;
 
-	new_ino = pintfs_empty_inode(sb);
+	new_ino = pintfs_empty_inode(dir, mode);
 
 	if(new_ino == -1){
 		printk("pintfs - inode table is full.\n");
+		iput(inode);
 		return NULL;
 	}
 
-	set_bitmap(sb, PINTFS_INODE_BITMAP_BLOCK, new_ino, 1);
 	inode_init_owner(inode, dir, mode);
 	cur_time = current_time(inode);
 
@@ -160,12 +299,48 @@ struct inode *pintfs_new_inode(const struct inode *dir, umode_t mode)
 	inode->i_size = 0;
 	inode->i_ctime = inode-> i_mtime = inode->i_atime = cur_time;
 
-	// Write pintfs_inode in disk!
-	pintfs_write_inode(sb, inode);
+	// slab objects are reused, start with an empty block map
+	pii = PINTFS_I(inode);
+	memset(pii->i_data, 0, sizeof(pii->i_data));
+	pii->i_flags = 0;
+	pii->i_next_lblk = 0;
+	pii->i_next_pblk = pintfs_first_goal(dir, inode);
+	if(S_ISREG(mode) &&
+			(PINTFS_SB(sb)->s_es->feature_incompat & PINTFS_FEATURE_INCOMPAT_INLINE_DATA)){
+		// data stays in i_block until it outgrows it
+		pii->i_flags |= PINTFS_INLINE_DATA_FL;
+	}
+	else if(S_ISREG(mode) &&
+			(PINTFS_SB(sb)->s_es->feature_incompat & PINTFS_FEATURE_INCOMPAT_EXTENTS)){
+		pii->i_flags |= PINTFS_EXTENTS_FL;
+		pintfs_ext_init(inode);
+	}
+
+	// hash first, mark_inode_dirty() ignores unhashed inodes
 	insert_inode_hash(inode);
+	mark_inode_dirty(inode);
 	return inode;
 }
 
+/*
+	pintfs_inode_block - inode table block holding inode 'ino', 0 if ino is bad
+*/
+unsigned int pintfs_inode_block(struct super_block *sb, unsigned long ino)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct buffer_head *gdbh;
+
+	if ((ino != PINTFS_ROOT_INO && ino < PINTFS_GOOD_FIRST_INO) ||
+			ino > sbi->s_es->inodes_count)
+		return 0;
+
+	desc = pintfs_get_group_desc(sb, pintfs_ino_group(sb, ino), &gdbh);
+	if(!desc)
+		return 0;
+	return desc->bg_inode_table + (ino - 1) % sbi->s_inodes_per_group / PINTFS_INODES_PER_BLOCK;
+}
+
 /*
 	pintfs_get_inode - Get pintfs_inode data in disk
 */
@@ -173,18 +348,19 @@ static struct pintfs_inode *pintfs_get_inode(struct super_block *sb, ino_t ino,
 {
 	struct buffer_head *bh;
 	unsigned long offset;
+	unsigned int block;
 
 	if(DEBUG)
 		printk("pintfs - pintfs_get_inode: ino=%ld\n",ino);
 
 	*p = NULL;
-	if ((ino != PINTFS_ROOT_INO && ino < PINTFS_GOOD_FIRST_INO) ||
-			ino > PINTFS_SB(sb)->s_es->inodes_count)
+	block = pintfs_inode_block(sb, ino);
+	if(!block)
 		goto Einval;
-
-	offset = (ino - 1) % PINTFS_INODES_PER_BLOCK * PINTFS_INODE_SIZE;
+	offset = (ino - 1) % PINTFS_SB(sb)->s_inodes_per_group % PINTFS_INODES_PER_BLOCK *
+		PINTFS_INODE_SIZE;
 	
-	if(!(bh = sb_bread(sb, pintfs_get_blocknum(ino))))
+	if(!(bh = sb_bread(sb, block)))
 		goto Eio;
 
 	*p = bh;
@@ -241,6 +417,7 @@ struct inode *pintfs_iget(struct super_block *sb, unsigned long ino)
 	else{
 		inode->i_op = &pintfs_file_inode_ops;
 		inode->i_fop = &pintfs_file_ops;
+		inode->i_mapping->a_ops = &pintfs_aops;
 	}
 
 	i_uid = raw_inode->i_uid;
@@ -250,6 +427,7 @@ struct inode *pintfs_iget(struct super_block *sb, unsigned long ino)
 	for(i=0; i<PINTFS_N_BLOCKS; i++){
 		pi->i_data[i] = raw_inode->i_block[i];
 	}
+	pi->i_flags = raw_inode->i_flags;
 
 	if (DEBUG)
 		printk("pintfs - pintfs_iget ok, inode=%p\n", inode);
@@ -265,7 +443,29 @@ bad_inode:
 }
 
 
-static int pintfs_setattr(struct dentry *dentry, struct iattr *attr){
+/*
+   pintfs_setattr - change attributes, truncate if size changes
+*/
+static int pintfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	int error;
+
+	if (DEBUG)
+		printk("pintfs - setattr: ino=%ld\n", inode->i_ino);
+
+	error = setattr_prepare(dentry, attr);
+	if(error)
+		return error;
+
+	if((attr->ia_valid & ATTR_SIZE) && attr->ia_size != inode->i_size){
+		error = pintfs_truncate(inode, attr->ia_size);
+		if(error)
+			return error;
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
 	return 0;
 }
 
@@ -274,6 +474,7 @@ static int pintfs_setattr(struct dentry *dentry, struct iattr *attr){
 */
 const struct inode_operations pintfs_file_inode_ops = {
 	.setattr = pintfs_setattr,
+	.fiemap = pintfs_fiemap,
 };
 
 
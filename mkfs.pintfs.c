@@ -2,27 +2,133 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 #include "pintfs_common.h"
 
+/*
+   pintfs_layout - group geometry computed from the device size
+*/
+struct pintfs_layout {
+	unsigned int blocks_count;
+	unsigned int groups_count;
+	unsigned int blocks_per_group;
+	unsigned int inodes_per_group;
+	unsigned int itb_per_group;	/* inode table blocks per group */
+	unsigned int gdb_count;		/* group descriptor blocks */
+};
+
+#define PINTFS_BLOCKS_PER_INODE	4	/* one inode per 16KB of disk */
+
+/*
+   group_first_block / group_meta_block - where group g starts, and where
+   its bitmaps and inode table start (after the superblock and the
+   descriptors in group 0)
+*/
+static unsigned int group_first_block(struct pintfs_layout *l, unsigned int g)
+{
+	return g * l->blocks_per_group;
+}
+
+static unsigned int group_meta_block(struct pintfs_layout *l, unsigned int g)
+{
+	return group_first_block(l, g) + (g == 0 ? PINTFS_GROUP_DESC_BLOCK + l->gdb_count : 0);
+}
+
+static unsigned int group_blocks(struct pintfs_layout *l, unsigned int g)
+{
+	if(g == l->groups_count - 1)
+		return l->blocks_count - group_first_block(l, g);
+	return l->blocks_per_group;
+}
+
+/*
+   device_blocks - size of the image file or block device in pintfs blocks
+*/
+static unsigned long long device_blocks(int fd)
+{
+	struct stat st;
+	unsigned long long size = 0;
+
+	if(fstat(fd, &st) < 0){
+		perror("Failed to stat device");
+		exit(1);
+	}
+	if(S_ISBLK(st.st_mode)){
+		if(ioctl(fd, BLKGETSIZE64, &size) < 0){
+			perror("Failed to get device size");
+			exit(1);
+		}
+	}
+	else
+		size = st.st_size;
+	return size / PINTFS_BLOCK_SIZE;
+}
+
+/*
+   compute_layout - cut the device in groups, dropping a last group too
+   small to hold its own metadata
+*/
+static void compute_layout(struct pintfs_layout *l, unsigned long long blocks)
+{
+	unsigned int overhead, last;
+
+	if(blocks > 0xFFFFFFFFULL)
+		blocks = 0xFFFFFFFFULL;
+	l->blocks_count = blocks;
+	l->blocks_per_group = PINTFS_BITS_PER_BLOCK;
+
+	// same inode count in every group, sized on a full (or the only) group
+	l->inodes_per_group = (blocks < l->blocks_per_group ? blocks : l->blocks_per_group)
+		/ PINTFS_BLOCKS_PER_INODE;
+	l->inodes_per_group = (l->inodes_per_group + PINTFS_INODES_PER_BLOCK - 1)
+		/ PINTFS_INODES_PER_BLOCK * PINTFS_INODES_PER_BLOCK;
+	if(l->inodes_per_group == 0)
+		l->inodes_per_group = PINTFS_INODES_PER_BLOCK;
+	l->itb_per_group = l->inodes_per_group / PINTFS_INODES_PER_BLOCK;
+
+	l->groups_count = (l->blocks_count + l->blocks_per_group - 1) / l->blocks_per_group;
+	l->gdb_count = (l->groups_count + PINTFS_DESC_PER_BLOCK - 1) / PINTFS_DESC_PER_BLOCK;
+
+	overhead = 2 + l->itb_per_group;
+	last = group_blocks(l, l->groups_count - 1);
+	if(l->groups_count > 1 && last < overhead + 1){
+		l->blocks_count -= last;
+		l->groups_count--;
+	}
+
+	// group 0 also needs the root directory block
+	if(l->blocks_count < group_meta_block(l, 0) + overhead + 1){
+		fprintf(stderr, "Device too small: %llu blocks\n", blocks);
+		exit(1);
+	}
+}
+
 /*
    init_super_block - Write superblock metadata in 0st block
 */
-void init_super_block(int fd){
+void init_super_block(int fd, struct pintfs_layout *l, unsigned int features){
 	struct pintfs_super_block sb;
 
+	memset(&sb, 0, sizeof(sb));
 	sb.magic = PINTFS_MAGIC_NUMBER;
 	sb.block_size = PINTFS_BLOCK_SIZE;
-	sb.inodes_count = PINTFS_INODE_BITMAP_SIZE;
-	sb.blocks_count = PINTFS_BLOCK_BITMAP_SIZE;
-	sb.free_blocks = sb.blocks_count - PINTFS_FIRST_DATA_BLOCK;
-	sb.free_inodes = sb.inodes_count - PINTFS_GOOD_FIRST_INO;
-	sb.inode_bitmap_block = PINTFS_INODE_BITMAP_BLOCK;
-	sb.block_bitmap_block = PINTFS_BLOCK_BITMAP_BLOCK;
-	sb.first_inode_block = PINTFS_FIRST_INODE_BLOCK;
-	sb.first_data_block = PINTFS_FIRST_DATA_BLOCK;
+	sb.blocksize_bits = PINTFS_BLOCK_BITS;
+	sb.inodes_count = l->groups_count * l->inodes_per_group;
+	sb.blocks_count = l->blocks_count;
+	sb.blocks_per_group = l->blocks_per_group;
+	sb.inodes_per_group = l->inodes_per_group;
+	sb.group_desc_block = PINTFS_GROUP_DESC_BLOCK;
+	sb.first_data_block = 0;
+	sb.free_blocks = sb.blocks_count - l->gdb_count - 1 - 1
+		- l->groups_count * (2 + l->itb_per_group);	// -1: root dir block
+	sb.free_inodes = sb.inodes_count - 1;
+	sb.rev_level = PINTFS_REV;
+	sb.feature_incompat = features;
 
 	// Disk is handled like file!
 	if (pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
@@ -32,30 +138,75 @@ void init_super_block(int fd){
 	}	
 }
 /*
-   init_bitmaps - Write bitmap datas in 1st, 2nd block and
+   set_bit_le - mark object 'nr' used (bit nr%8 of byte nr/8, like the kernel's *_bit_le)
 */
-void init_bitmaps(int fd){
-	unsigned char bitmap_block[PINTFS_BLOCK_SIZE];
-	int i;
-	memset(bitmap_block, 0, PINTFS_BLOCK_SIZE);
-	for(i = 0; i <= PINTFS_ROOT_INO; i++)
-		bitmap_block[i] = 1;
-
-	if (pwrite(fd, bitmap_block, PINTFS_BLOCK_SIZE, PINTFS_BLOCK_SIZE * 1) != PINTFS_BLOCK_SIZE) {
-		perror("Failed to wrtie inode_bitmap");
+static void set_bit_le(unsigned char *bitmap, int nr)
+{
+	bitmap[nr / 8] |= 1 << (nr % 8);
+}
+/*
+   write_block - write one block, exit on failure
+*/
+static void write_block(int fd, const void *buf, unsigned int block, const char *what)
+{
+	if (pwrite(fd, buf, PINTFS_BLOCK_SIZE, (off_t)PINTFS_BLOCK_SIZE * block) != PINTFS_BLOCK_SIZE) {
+		fprintf(stderr, "Failed to write %s: ", what);
+		perror(NULL);
 		close(fd);
 		exit(1);
-	}	
-	
-	memset(bitmap_block, 0, PINTFS_BLOCK_SIZE);
-	for(i = 0; i <= PINTFS_FIRST_DATA_BLOCK; i++)
-		bitmap_block[i] = 1;
+	}
+}
+/*
+   init_groups - Write the group descriptors, bitmaps and empty inode tables
+   Every bitmap holds one bit per inode / block of its group. Group 0
+   also holds the root inode and the root directory block.
+*/
+void init_groups(int fd, struct pintfs_layout *l){
+	unsigned char block[PINTFS_BLOCK_SIZE];
+	unsigned char *gdt;
+	struct pintfs_group_desc *desc;
+	unsigned int g, i, meta, used;
 
-	if (pwrite(fd, bitmap_block, PINTFS_BLOCK_SIZE, PINTFS_BLOCK_SIZE * 2) != PINTFS_BLOCK_SIZE) {
-		perror("Failed to wrtie block_bitmap");
-		close(fd);
+	gdt = calloc(l->gdb_count, PINTFS_BLOCK_SIZE);
+	if(!gdt){
+		perror("Failed to alloc group descriptors");
 		exit(1);
 	}
+
+	for(g = 0; g < l->groups_count; g++){
+		meta = group_meta_block(l, g);
+		desc = (struct pintfs_group_desc *)gdt + g;
+		desc->bg_block_bitmap = meta;
+		desc->bg_inode_bitmap = meta + 1;
+		desc->bg_inode_table = meta + 2;
+
+		// everything up to the end of the inode table, plus the root dir in group 0
+		used = meta + 2 + l->itb_per_group - group_first_block(l, g) + (g == 0);
+		desc->bg_free_blocks_count = group_blocks(l, g) - used;
+		desc->bg_free_inodes_count = l->inodes_per_group - (g == 0);
+
+		memset(block, 0, PINTFS_BLOCK_SIZE);
+		for(i = 0; i < used; i++)
+			set_bit_le(block, i);
+		// bits past the end of a short last group are never free
+		for(i = group_blocks(l, g); i < PINTFS_BITS_PER_BLOCK; i++)
+			set_bit_le(block, i);
+		write_block(fd, block, desc->bg_block_bitmap, "block_bitmap");
+
+		memset(block, 0, PINTFS_BLOCK_SIZE);
+		if(g == 0)
+			set_bit_le(block, PINTFS_ROOT_INO - 1);
+		write_block(fd, block, desc->bg_inode_bitmap, "inode_bitmap");
+
+		memset(block, 0, PINTFS_BLOCK_SIZE);
+		for(i = 0; i < l->itb_per_group; i++)
+			write_block(fd, block, desc->bg_inode_table + i, "inode_table");
+	}
+
+	for(i = 0; i < l->gdb_count; i++)
+		write_block(fd, gdt + i * PINTFS_BLOCK_SIZE, PINTFS_GROUP_DESC_BLOCK + i,
+				"group_desc");
+	free(gdt);
 }
 /*
 #define S_IFDIR	0040000;
@@ -80,25 +231,27 @@ void init_bitmaps(int fd){
 #define S_IWUGO		(S_IWUSR|S_IWGRP|S_IWOTH)
 #define S_IXUGO		(S_IXUSR|S_IXGRP|S_IXOTH)
 /*
-   init_root_inode_info - Write root inode in 3rd block
+   init_root_inode_info - Write root inode, the first slot of group 0's inode table
 */
-void init_root_inode_info(int fd)
+void init_root_inode_info(int fd, struct pintfs_layout *l)
 {
 	struct pintfs_inode root_inode;
+	unsigned int table = group_meta_block(l, 0) + 2;
 	
+	memset(&root_inode, 0, sizeof(root_inode));
 	root_inode.i_mode = S_IRUGO|S_IWUGO|S_IXUGO|S_IFDIR;
 	root_inode.i_uid = 1000;
-	root_inode.i_size = 0;
+	root_inode.i_size = PINTFS_BLOCK_SIZE; // one linear directory block
 	root_inode.i_time = time(NULL);
 	for(int i=0; i<PINTFS_N_BLOCKS; i++){
 		if(i == 0)
-			root_inode.i_block[i] = PINTFS_FIRST_DATA_BLOCK; //Not 5th block address, Just 5!
+			root_inode.i_block[i] = table + l->itb_per_group; // first data block of group 0
 		else
 			root_inode.i_block[i] = 0;
 	}
 	root_inode.i_blocks = 0; 
 
-	if (pwrite(fd, &root_inode, sizeof(struct pintfs_inode), PINTFS_BLOCK_SIZE * 3) 
+	if (pwrite(fd, &root_inode, sizeof(struct pintfs_inode), (off_t)PINTFS_BLOCK_SIZE * table) 
 				!= sizeof(struct pintfs_inode))
 	{
 		perror("Failed to wrtie root_inode");
@@ -107,51 +260,63 @@ void init_root_inode_info(int fd)
 	}
 }
 /*
-   write_root_dir_entry - Write root dir_entry int 5th block
+   init_root_dir_block - Write empty root directory block after group 0's inode table
 */
-void write_root_dir_entry(int fd)
+void init_root_dir_block(int fd, struct pintfs_layout *l)
 {
-	struct pintfs_dir_entry dir_entries[2];
-
-	strcpy(dir_entries[0].name, ".");
-	dir_entries[0].inode_number = PINTFS_ROOT_INO;
-
-	strcpy(dir_entries[1].name, "..");
-	dir_entries[1].inode_number = PINTFS_ROOT_INO;
+	unsigned char dir_block[PINTFS_BLOCK_SIZE];
 
-	if(pwrite(fd, dir_entries, sizeof(dir_entries), PINTFS_BLOCK_SIZE * PINTFS_FIRST_DATA_BLOCK)
-			!= sizeof(dir_entries))
-	{
-		perror("Failed to write root_dir_entry");
-		close(fd);
-		exit(1);
-	}
+	memset(dir_block, 0, PINTFS_BLOCK_SIZE);
+	write_block(fd, dir_block, group_meta_block(l, 0) + 2 + l->itb_per_group,
+			"root_dir_block");
 }
 	
 
 int main(int argc, char *argv[]) {
-	
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <device>\n", argv[0]);
+	struct pintfs_layout layout;
+	unsigned int features = 0;
+	int opt;
+
+	// -e : map regular files with extents
+	// -i : keep small regular files inline in the inode
+	while ((opt = getopt(argc, argv, "ei")) != -1) {
+		switch (opt) {
+		case 'e':
+			features |= PINTFS_FEATURE_INCOMPAT_EXTENTS;
+			break;
+		case 'i':
+			features |= PINTFS_FEATURE_INCOMPAT_INLINE_DATA;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-e] [-i] <device>\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-e] [-i] <device>\n", argv[0]);
 		exit(1);
 	}
 
-	int fd = open(argv[1], O_RDWR);
+	int fd = open(argv[optind], O_RDWR);
 	if (fd < 0){
 		perror("Failed to Open Device");
 		exit(1);
 	}
 
-	init_super_block(fd);
+	compute_layout(&layout, device_blocks(fd));
+	printf("Pintfs %u blocks, %u groups, %u inodes per group\n",
+			layout.blocks_count, layout.groups_count, layout.inodes_per_group);
+
+	init_super_block(fd, &layout, features);
 	printf("Pintfs init super_block ok\n");
-	init_bitmaps(fd);
-	printf("Pintfs init bitmap ok\n");
-	init_root_inode_info(fd);
+	init_groups(fd, &layout);
+	printf("Pintfs init groups ok\n");
+	init_root_inode_info(fd, &layout);
 	printf("Pintfs init root_inode_info ok\n");
-	//write_root_dir_entry(fd);
-	//printf("Pintfs init root_dir_entry ok\n");
+	init_root_dir_block(fd, &layout);
+	printf("Pintfs init root_dir_block ok\n");
 
-	printf("Pintfs init successed on %s\n",argv[1]);
+	printf("Pintfs init successed on %s\n",argv[optind]);
 	close(fd);
 
 	return 0;
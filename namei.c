@@ -5,15 +5,34 @@
 #include "pintfs.h"
 #define DEBUG 1
 
+/*
+   pintfs_forget_inode - drop a new inode that never got a dir_entry
+   evict_inode frees its blocks and number.
+*/
+static void pintfs_forget_inode(struct inode *inode)
+{
+	clear_nlink(inode);
+	iput(inode);
+}
+
+/*
+   pintfs_dec_dir_count - a subdirectory of dir is gone
+   Directories keep no link count on disk and are read in with 1, which
+   means "not counted" (like ext4's dir_nlink); such a count never drops.
+*/
+static void pintfs_dec_dir_count(struct inode *dir)
+{
+	if(dir->i_nlink > 2)
+		drop_nlink(dir);
+}
+
 /*
    pintfs_create - create a new file in a directory
 */
 static int pintfs_create(struct inode *dir, struct dentry* dentry, umode_t mode, bool excl)
 {
 	struct inode *inode;
-	struct buffer_head *bh;
-	struct pintfs_dir_entry *pde;
-	int i, num_dirs;
+	int err;
 	if (DEBUG)
 		printk("pintfs - create\n");
 
@@ -23,37 +42,18 @@ static int pintfs_create(struct inode *dir, struct dentry* dentry, umode_t mode,
 	
 	inode->i_op = &pintfs_file_inode_ops;
 	inode->i_fop = &pintfs_file_ops;
+	inode->i_mapping->a_ops = &pintfs_aops;
 	inode->i_mode = mode;
 
 	// Write pintfs_dir_entry in dir!
-	bh = pintfs_sb_bread_dir(dir); 
-	num_dirs = NUM_DIRS;
-	pde = (struct pintfs_dir_entry *)((bh->b_data));
-	for(i=0; i<num_dirs; i++){
-		if (pde->inode_number == 0){
-			break;
-		}
-		pde++;
-	}
-	if(i == num_dirs){
-		brelse(bh);
-		iput(inode);
-		return -ENOSPC;
+	err = pintfs_add_entry(dir, &dentry->d_name, inode);
+	if(err){
+		pintfs_forget_inode(inode);
+		return err;
 	}
 
-	strncpy(pde->name, dentry->d_name.name, dentry->d_name.len);
-	pde->name[dentry->d_name.len] = '\0';
-	pde->inode_number = inode->i_ino;
-
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-	pintfs_write_inode(inode->i_sb, inode);
-
-	dir->i_size += sizeof(struct pintfs_dir_entry);
-	dir->i_atime = current_time(dir);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
 	d_instantiate(dentry, inode);
-	pintfs_write_inode(dir->i_sb, dir);
 
 	mark_inode_dirty(dir);
 	mark_inode_dirty(inode);
@@ -70,42 +70,28 @@ static struct dentry *pintfs_lookup(struct inode *dir,
 
 	struct buffer_head *bh;
 	struct inode *inode = NULL;
-	int i, num_dirs;
 	struct pintfs_dir_entry *pde;
+	unsigned int ino;
 
 	if(DEBUG)
 		printk("pintfs - lookup\n");
 
-	bh = pintfs_sb_bread_dir(dir); 
-	if(!bh)
-		return ERR_PTR(-EIO);
+	if(dentry->d_name.len > MAX_NAME_SIZE)
+		return ERR_PTR(-ENAMETOOLONG);
 
-	num_dirs = PINTFS_BLOCK_SIZE / sizeof(struct pintfs_dir_entry);
-	
-	for(i=0; i<num_dirs; i++){
-		pde = (struct pintfs_dir_entry *)((bh->b_data) + i*sizeof(struct pintfs_dir_entry));
-
-		if(pde->inode_number <= 0)
-			continue;
-
-		if(strlen(pde->name) == dentry->d_name.len &&
-				strncmp(pde->name, dentry->d_name.name, dentry->d_name.len) == 0){ 
-			inode = pintfs_iget(dir->i_sb, pde->inode_number);
-
-			if(!inode){
-				brelse(bh);
-				return ERR_PTR(-ENOENT);
-			}
-			
-			brelse(bh);
-			d_add(dentry, inode);
-			return NULL;
-		}
+	pde = pintfs_find_entry(dir, &dentry->d_name, &bh, NULL);
+	if(IS_ERR(pde))
+		return ERR_CAST(pde);
+
+	if(pde){
+		ino = pde->inode_number;
+		brelse(bh);
+		inode = pintfs_iget(dir->i_sb, ino);
+		if(IS_ERR(inode))
+			return ERR_CAST(inode);
 	}
 
-	brelse(bh);
-	d_add(dentry, inode);
-	return NULL;
+	return d_splice_alias(inode, dentry);
 }
 
 /*
@@ -114,15 +100,11 @@ static struct dentry *pintfs_lookup(struct inode *dir,
 static int pintfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 	struct inode *inode;
-	struct pintfs_inode_info *pii;
 	struct buffer_head *bh;
-	int num_dirs, i, new_blockno;
-	struct pintfs_dir_entry *pde;
+	int err;
 	if(DEBUG)
 		printk("pintfs - mkdir\n");
 
-	// Just get inode_number?
-	// NO. Set block too.
 	inode = pintfs_new_inode(dir, S_IFDIR | mode);
 	if(!inode)
 		return -ENOSPC;
@@ -130,39 +112,26 @@ static int pintfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	inode->i_fop = &pintfs_dir_ops;
 	inode->i_mode = S_IFDIR | mode;
 
-	new_blockno = pintfs_empty_block(dir->i_sb);
-	pii = PINTFS_I(inode);
-	pii->i_data[0] = new_blockno;
-	set_bitmap(dir->i_sb, PINTFS_BLOCK_BITMAP_BLOCK, new_blockno, 1);
-
-	if (!dir)
-		return -1;
-	
-	bh = pintfs_sb_bread_dir(dir); 
-	num_dirs = PINTFS_BLOCK_SIZE / sizeof(struct pintfs_dir_entry);
-
-	for(i=0; i<num_dirs; i++){
-		pde = (struct pintfs_dir_entry *)((bh->b_data) + i*sizeof(struct pintfs_dir_entry));
-		if(pde->inode_number == 0)
-			break;
+	// a new directory is one empty linear block
+	bh = pintfs_dir_bread(inode, 0, 1);
+	if(IS_ERR(bh)){
+		pintfs_forget_inode(inode);
+		return PTR_ERR(bh);
 	}
-
-	strncpy(pde->name, dentry->d_name.name, dentry->d_name.len);
-	pde->name[dentry->d_name.len] = '\0';
-	pde->inode_number = inode->i_ino;
-	
-	pintfs_write_inode(inode->i_sb, inode);
-
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
 	brelse(bh);
+	inode->i_size = PINTFS_BLOCK_SIZE;
+
+	err = pintfs_add_entry(dir, &dentry->d_name, inode);
+	if(err){
+		pintfs_forget_inode(inode);
+		return err;
+	}
 
-	dir->i_size += sizeof(struct pintfs_dir_entry);
-	dir->i_atime = current_time(dir);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
 	d_instantiate(dentry, inode);
-	pintfs_write_inode(dir->i_sb, dir);
 
 	mark_inode_dirty(dir);
+	mark_inode_dirty(inode);
 	printk("Directory created\n");
 	return 0;
 }
@@ -173,44 +142,27 @@ static int pintfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 static int pintfs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct buffer_head *bh;
-	struct inode *inode;
-	int num_dirs, i, k;
-	struct pintfs_dir_entry *pde, *dent1, *dent2;
+	struct inode *inode = d_inode(dentry);
+	struct pintfs_dir_entry *pde;
+	unsigned int lblk;
 	if(DEBUG)
 		printk("pintfs - unlink\n");
 
-	bh = pintfs_sb_bread_dir(dir); 
-	num_dirs = dir->i_size / sizeof(struct pintfs_dir_entry);
-
-	for(i=0; i<num_dirs; i++){
-		pde = (struct pintfs_dir_entry *)((bh->b_data) + i*sizeof(struct pintfs_dir_entry));
-		if(strlen(pde->name) == dentry->d_name.len &&
-				strncmp(pde->name, dentry->d_name.name, dentry->d_name.len) == 0){
-			inode = pintfs_iget(dir->i_sb, pde->inode_number);
-			if(!inode)
-				return -ENONET;
-
-			dir->i_size -= sizeof(struct pintfs_dir_entry);
-			for(k=i+1; k< num_dirs; k++){
-				dent1 = (struct pintfs_dir_entry *) ((bh->b_data) + (k-1)*sizeof(struct pintfs_dir_entry));
-				dent2 = (struct pintfs_dir_entry *) ((bh->b_data) + (k)*sizeof(struct pintfs_dir_entry));
-				strcpy(dent1->name, dent2->name);
-				dent1->inode_number = dent2->inode_number;
-			}
-			
-			mark_buffer_dirty(bh);
-			sync_dirty_buffer(bh);	
-			pintfs_write_inode(dir->i_sb, dir);
-
-			mark_inode_dirty(dir);
-			inode_dec_link_count(inode);
-
-			brelse(bh);
-			return 0;
-		}
-	}
+	pde = pintfs_find_entry(dir, &dentry->d_name, &bh, &lblk);
+	if(IS_ERR(pde))
+		return PTR_ERR(pde);
+	if(!pde)
+		return -ENOENT;
+
+	pintfs_delete_entry(dir, lblk, pde, bh);
 	brelse(bh);
-	return -ENOENT;
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+
+	inode->i_ctime = dir->i_ctime;
+	inode_dec_link_count(inode);
+	return 0;
 }
 
 /*
@@ -219,22 +171,23 @@ static int pintfs_unlink(struct inode *dir, struct dentry *dentry)
 static int pintfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = d_inode(dentry);
-	int err = -ENOTEMPTY;
+	int err;
 
 	if (DEBUG)
 		printk("pintfs - rmdir\n");
 
-	if(pintfs_empty_dir(inode)){
-		err = pintfs_unlink(dir, dentry);
-		if(!err) {
-			inode->i_size = 0;
-			//inode_dec_link_count(inode);
-		}
-	}
+	err = pintfs_empty_dir(inode);
+	if(err <= 0)
+		return err ? err : -ENOTEMPTY;
 
-	set_bitmap(inode->i_sb, PINTFS_INODE_BITMAP_BLOCK, inode->i_ino, 0);
-	set_bitmap(inode->i_sb, PINTFS_BLOCK_BITMAP_BLOCK, PINTFS_I(inode)->i_data[0], 0);
-	return err;
+	err = pintfs_unlink(dir, dentry);
+	if(err)
+		return err;
+
+	// blocks and number go in evict_inode, once nobody holds the inode
+	clear_nlink(inode);
+	pintfs_dec_dir_count(dir);
+	return 0;
 }
 
 /*
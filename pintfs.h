@@ -2,43 +2,129 @@
 #include <linux/types.h>
 #include <linux/module.h>
 #include <linux/buffer_head.h>
+#include <linux/blockgroup_lock.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
 #include "pintfs_common.h"
-#define NUM_DIRS (PINTFS_BLOCK_SIZE / sizeof(struct pintfs_dir_entry))
 #define DEBUG 1
 /*
    pintfs_inode_info - PINTFS Inode info
 */
 struct pintfs_inode_info {
-	unsigned int	i_data[15];
+	unsigned int	i_data[15];	/* block map or extent root, under i_map_sem */
+	unsigned int	i_flags;	/* PINTFS_*_FL */
+	struct rw_semaphore i_map_sem;	/* read: lookup, write: allocate/truncate */
+	struct rw_semaphore i_mmap_sem;	/* read: page faults, write: truncate/punch */
+	unsigned int	i_next_lblk;	/* file block after the last one allocated */
+	unsigned int	i_next_pblk;	/* goal for i_next_lblk, 0: none */
+	bool		i_alloc_reserved; /* allocating for delayed buffers, under i_map_sem */
+	unsigned char	*i_dir_free;	/* dir: lowest maybe-free slot per block, under i_rwsem */
+	unsigned int	i_dir_nfree;	/* entries in i_dir_free */
 	struct inode	vfs_inode;
 };
 
+/*
+   pintfs_group_info - in-memory state of a block group
+*/
+struct pintfs_group_info {
+	struct rb_root	gi_free;	/* free extents, under the group lock */
+	bool		gi_loaded;	/* gi_free was built from the bitmap */
+	struct buffer_head *gi_block_bh; /* block bitmap, pinned from first use */
+	struct buffer_head *gi_inode_bh; /* inode bitmap, pinned from first use */
+	unsigned int	gi_inode_hint;	/* next-fit start for inode allocation, under the group lock */
+};
+
 /*
    pintfs_sb_info - Pintfs Superblock Info
 */
 struct pintfs_sb_info {
-	struct pintfs_super_block *s_es; /* pintfs_super_block */
+	struct pintfs_super_block *s_es; /* pintfs_super_block, in s_sbh */
+	struct buffer_head *s_sbh;	/* superblock buffer, pinned while mounted */
 	int s_first_ino; /* First inode (2) */
 	int s_inode_size;		/* Inode byte 크기 (64bytes)*/
+	unsigned int s_groups_count;
+	unsigned int s_blocks_per_group;
+	unsigned int s_inodes_per_group;
+	unsigned int s_itb_per_group;	/* inode table blocks per group */
+	unsigned int s_gdb_count;	/* group descriptor blocks */
+	struct buffer_head **s_group_desc; /* descriptor blocks, pinned while mounted */
+	struct blockgroup_lock *s_blockgroup_lock; /* group bitmaps and free counts */
+	struct pintfs_group_info *s_group_info; /* free extent trees, one per group */
+	struct mutex s_group_load_mutex;	/* building a free extent tree */
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct percpu_counter s_dirtyblocks_counter;	/* reserved for delayed buffers */
 };
 
 
+/* fake address of a delayed buffer, never a real block */
+#define PINTFS_DELAY_BLOCK	(~(sector_t)0)
+/* most blocks one delayed writeback allocation grabs */
+#define PINTFS_DELAY_MAX_RUN	1024
+/* create value of pintfs_get_blocks that may use space reserved for delayed buffers */
+#define PINTFS_CREATE_RESERVED	2
+/* blocks read ahead past a map or directory block that missed the cache */
+#define PINTFS_META_RA		8
+
 /* balloc.c */
-int pintfs_empty_block(struct super_block *sb);
+struct pintfs_group_desc *pintfs_get_group_desc(struct super_block *sb,
+		unsigned int group, struct buffer_head **bh);
+int pintfs_find_free_bit(void *bitmap, unsigned int first,
+		unsigned int count, unsigned int hint);
+struct buffer_head *pintfs_read_inode_bitmap(struct super_block *sb, unsigned int group,
+		struct pintfs_group_desc *desc);
+void pintfs_release_bitmaps(struct super_block *sb);
+unsigned int pintfs_find_goal(struct inode *inode, unsigned long iblock, unsigned int near);
+int pintfs_new_blocks(struct inode *inode, unsigned int goal, unsigned int *count);
+int pintfs_empty_block(struct inode *inode, unsigned int goal);
+void pintfs_free_blocks(struct super_block *sb, unsigned int block_no, unsigned int count);
+void pintfs_free_block(struct super_block *sb, unsigned int block_no);
+int pintfs_reserve_blocks(struct super_block *sb, unsigned int count);
+void pintfs_release_blocks(struct super_block *sb, unsigned int count);
+void pintfs_release_free_extents(struct rb_root *root);
 /* super.c */
 extern const struct super_operations pintfs_super_ops;
-int set_bitmap(struct super_block *sb, int bno, int no, int val);
 /* file.c */
 extern const struct file_operations pintfs_file_ops;
+extern const struct address_space_operations pintfs_aops;
+int pintfs_get_blocks(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		int create, unsigned int *bno, bool *new);
+int pintfs_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create);
+void pintfs_truncate_blocks(struct inode *inode, loff_t offset);
+int pintfs_truncate(struct inode *inode, loff_t size);
+int pintfs_inline_convert(struct inode *inode);
+int pintfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len);
+int pintfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 /* inode.c */
 extern const struct inode_operations pintfs_file_inode_ops;
-int pintfs_write_inode(struct super_block *sb, struct inode* inode);
-int pintfs_empty_inode(struct super_block *sb);
+int pintfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+void pintfs_dirty_inode(struct inode *inode, int flags);
+int pintfs_empty_inode(const struct inode *dir, umode_t mode);
+void pintfs_free_ino(struct super_block *sb, unsigned long ino);
+unsigned int pintfs_inode_block(struct super_block *sb, unsigned long ino);
 void pintfs_evict_inode(struct inode *inode);
 struct inode *pintfs_iget(struct super_block *sb, unsigned long ino);
 struct inode *pintfs_new_inode(const struct inode *dir, umode_t mode);
+/* extents.c */
+void pintfs_ext_init(struct inode *inode);
+int pintfs_ext_get_blocks(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		int create, unsigned int *bno, bool *new);
+int pintfs_ext_truncate(struct inode *inode, unsigned long first);
+int pintfs_ext_map(struct inode *inode, sector_t iblock, unsigned int maxblocks,
+		unsigned int *pblk, bool *unwritten, unsigned int *near, bool nowait);
+int pintfs_ext_prealloc(struct inode *inode, unsigned int lblk, unsigned int count);
+int pintfs_ext_punch(struct inode *inode, unsigned int first, unsigned int end);
 /* dir_c */
 extern const struct file_operations pintfs_dir_ops;
+struct buffer_head *pintfs_dir_bread(struct inode *dir, unsigned int lblk, int create);
+struct pintfs_dir_entry *pintfs_find_entry(struct inode *dir, const struct qstr *name,
+		struct buffer_head **res_bh, unsigned int *res_lblk);
+int pintfs_add_entry(struct inode *dir, const struct qstr *name, struct inode *inode);
+void pintfs_delete_entry(struct inode *dir, unsigned int lblk,
+		struct pintfs_dir_entry *pde, struct buffer_head *bh);
 int pintfs_empty_dir(struct inode *inode);
 /* namei.c */
 extern const struct inode_operations pintfs_dir_inode_ops;
@@ -48,9 +134,34 @@ static inline struct pintfs_sb_info *PINTFS_SB(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
-static inline int pintfs_get_blocknum(int inum)
+static inline spinlock_t *pintfs_group_lock(struct pintfs_sb_info *sbi,
+		unsigned int group)
+{
+	return bgl_lock_ptr(sbi->s_blockgroup_lock, group);
+}
+
+static inline unsigned int pintfs_ino_group(struct super_block *sb, unsigned long ino)
 {
-	return PINTFS_FIRST_INODE_BLOCK + (inum - 1) / PINTFS_INODES_PER_BLOCK; 
+	return (ino - 1) / PINTFS_SB(sb)->s_inodes_per_group;
+}
+
+static inline unsigned int pintfs_group_first_block(struct super_block *sb,
+		unsigned int group)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+
+	return sbi->s_es->first_data_block + group * sbi->s_blocks_per_group;
+}
+
+/* the last group may be shorter than blocks_per_group */
+static inline unsigned int pintfs_group_blocks(struct super_block *sb,
+		unsigned int group)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+
+	if(group == sbi->s_groups_count - 1)
+		return sbi->s_es->blocks_count - pintfs_group_first_block(sb, group);
+	return sbi->s_blocks_per_group;
 }
 
 static inline struct pintfs_inode_info *PINTFS_I(struct inode* inode)
@@ -58,18 +169,43 @@ static inline struct pintfs_inode_info *PINTFS_I(struct inode* inode)
 	return container_of(inode, struct pintfs_inode_info, vfs_inode);
 }
 
-static inline struct buffer_head *pintfs_sb_bread_dir(struct inode* inode)
-{	
-	return sb_bread(inode->i_sb, PINTFS_I(inode)->i_data[0]);
+/* file data is kept in i_block instead of data blocks */
+static inline bool pintfs_is_inline(struct inode *inode)
+{
+	return PINTFS_I(inode)->i_flags & PINTFS_INLINE_DATA_FL;
 }
 
-static inline struct buffer_head *pintfs_sb_bread_file(struct inode* inode, int block_index)
+/*
+   pintfs_dirty_buffer - mark metadata buffer dirty
+   Writeback flushes it later; a "sync" mount writes it out right away.
+*/
+static inline void pintfs_dirty_buffer(struct super_block *sb, struct buffer_head *bh)
 {
-	int block_no = PINTFS_I(inode)->i_data[block_index];
-	if(block_no <= 0)
+	mark_buffer_dirty(bh);
+	if(sb->s_flags & SB_SYNCHRONOUS)
+		sync_dirty_buffer(bh);
+}
+
+/* pintfs_block_cached - whether reading 'block' needs no I/O */
+static inline bool pintfs_block_cached(struct super_block *sb, unsigned int block)
+{
+	struct buffer_head *bh = sb_find_get_block(sb, block);
+	bool ret = bh && buffer_uptodate(bh);
+
+	brelse(bh);
+	return ret;
+}
+
+/* pintfs_bread_cached - 'block' if it is uptodate in memory, else NULL; never does I/O */
+static inline struct buffer_head *pintfs_bread_cached(struct super_block *sb, unsigned int block)
+{
+	struct buffer_head *bh = sb_find_get_block(sb, block);
+
+	if(bh && !buffer_uptodate(bh)){
+		brelse(bh);
 		return NULL;
-	else
-		return sb_bread(inode->i_sb, block_no);	
+	}
+	return bh;
 }
 
 static inline void print_pintfs_inode(struct pintfs_inode *pi){
@@ -1,23 +1,53 @@
 #define PINTFS_MAGIC_NUMBER 0xDEADBEEF
-#define PINTFS_BLOCK_SIZE (1 << 12) /* 4KB */
+#define PINTFS_REV			4	/* 1: one bit per object in bitmaps
+						   2: directory i_size counts blocks, hashed index
+						   3: aligned dir_entry, tagged directory blocks
+						   4: block groups */
+#define PINTFS_BLOCK_BITS	12
+#define PINTFS_BLOCK_SIZE (1 << PINTFS_BLOCK_BITS) /* 4KB */
 #define PINTFS_N_BLOCKS		8
 
-#define PINTFS_MAX_FILE_SIZE (PINTFS_BLOCK_SIZE) * PINTFS_N_BLOCKS;
-#define PINTFS_INODE_BITMAP_SIZE	128
-#define PINTFS_BLOCK_BITMAP_SIZE	64
+/* i_block[] layout: 6 direct, 1 indirect, 1 double indirect */
+#define PINTFS_NDIR_BLOCKS	6
+#define PINTFS_IND_BLOCK	PINTFS_NDIR_BLOCKS
+#define PINTFS_DIND_BLOCK	(PINTFS_IND_BLOCK + 1)
+#define PINTFS_ADDR_PER_BLOCK	(PINTFS_BLOCK_SIZE / sizeof(unsigned int))
+
+#define PINTFS_MAX_FILE_BLOCKS	(PINTFS_NDIR_BLOCKS + PINTFS_ADDR_PER_BLOCK + \
+		PINTFS_ADDR_PER_BLOCK * PINTFS_ADDR_PER_BLOCK)
+#define PINTFS_MAX_FILE_SIZE ((long long)PINTFS_BLOCK_SIZE * PINTFS_MAX_FILE_BLOCKS)
+#define PINTFS_BITS_PER_BLOCK		(PINTFS_BLOCK_SIZE * 8)
 #define PINTFS_INODES_PER_BLOCK		(PINTFS_BLOCK_SIZE / PINTFS_INODE_SIZE) 
+#define PINTFS_DESC_PER_BLOCK		(PINTFS_BLOCK_SIZE / sizeof(struct pintfs_group_desc))
 
+/*
+   Block groups - the disk is cut in groups of blocks_per_group blocks.
+   Every group starts with its block bitmap, inode bitmap and inode table.
+   Group 0 first holds the superblock and the group descriptor table.
+*/
 #define PINTFS_SUPER_BLOCK			0
-#define PINTFS_INODE_BITMAP_BLOCK	1
-#define PINTFS_BLOCK_BITMAP_BLOCK	2
-#define PINTFS_FIRST_INODE_BLOCK	3
-#define PINTFS_FIRST_DATA_BLOCK		5
+#define PINTFS_GROUP_DESC_BLOCK		1
 
 #define PINTFS_BAD_INO		0
 #define PINTFS_ROOT_INO		1
 #define PINTFS_GOOD_FIRST_INO 2
 
-#define MAX_NAME_SIZE 15
+#define MAX_NAME_SIZE 24
+
+/* feature_incompat - the kernel refuses to mount with unknown bits set */
+#define PINTFS_FEATURE_INCOMPAT_EXTENTS	0x0001	/* regular files are extent mapped */
+#define PINTFS_FEATURE_INCOMPAT_UNWRITTEN	0x0002	/* extents may be unwritten */
+#define PINTFS_FEATURE_INCOMPAT_INLINE_DATA	0x0004	/* small files live in i_block */
+#define PINTFS_FEATURE_INCOMPAT_SUPP	(PINTFS_FEATURE_INCOMPAT_EXTENTS | \
+		PINTFS_FEATURE_INCOMPAT_UNWRITTEN | PINTFS_FEATURE_INCOMPAT_INLINE_DATA)
+
+/* pintfs_inode.i_flags */
+#define PINTFS_EXTENTS_FL	0x0001	/* i_block holds an extent tree root */
+#define PINTFS_INDEX_FL		0x0002	/* directory block 0 is a pintfs_dx_root */
+#define PINTFS_INLINE_DATA_FL	0x0004	/* i_block holds the file data itself */
+
+/* bytes of file data an inline inode can hold */
+#define PINTFS_INLINE_DATA_SIZE	(PINTFS_N_BLOCKS * sizeof(unsigned int))
 
 /* 
 	pintfs_super_block - Superblock Metadata (It is on 0 block)
@@ -28,13 +58,27 @@ struct pintfs_super_block {
 	unsigned int	inodes_count;		/* 총 Inode 개수 */
 	unsigned int	blocks_count;		/* 총 block 개수 */
 	unsigned int	blocksize_bits;	/* block size 비트로(12) */
-	unsigned int	free_blocks;	/* 사용가능 blocks */
-	unsigned int	free_inodes;	/* 사용가능 inodes */
-	int				inode_bitmap_block; /* inode bitmap이 저장된 block 위치 */
-	int				block_bitmap_block; /* block bitmap이 저장된 block 위치 */
-	int				first_inode_block; /* pintfs_inode가 저장된 block 위치 */
-	unsigned int	first_data_block;	/* 5 */
+	unsigned int	free_blocks;	/* 사용가능 blocks, updated at sync */
+	unsigned int	free_inodes;	/* 사용가능 inodes, updated at sync */
+	unsigned int	blocks_per_group;	/* group 크기 (block bitmap bits) */
+	unsigned int	inodes_per_group;	/* multiple of PINTFS_INODES_PER_BLOCK */
+	unsigned int	group_desc_block;	/* first group descriptor block (1) */
+	unsigned int	first_data_block;	/* first block of group 0 (0) */
+	unsigned int	rev_level;		/* on-disk format revision */
+	unsigned int	feature_incompat;	/* PINTFS_FEATURE_INCOMPAT_* */
 };
+/*
+   pintfs_group_desc - one per group, packed in the blocks after the superblock
+*/
+struct pintfs_group_desc {
+	unsigned int	bg_block_bitmap;	/* block bitmap block */
+	unsigned int	bg_inode_bitmap;	/* inode bitmap block */
+	unsigned int	bg_inode_table;		/* first inode table block */
+	unsigned int	bg_free_blocks_count;
+	unsigned int	bg_free_inodes_count;
+	unsigned int	bg_reserved[3];
+};
+
 /*
    pintfs_inode
 */
@@ -43,15 +87,79 @@ struct pintfs_inode {
 	int i_uid;		/* Low 16 bits of Owner Uid */
 	ssize_t i_size;		/* Size in bytes */
 	long long i_time;		/* Access, Create, Modificate, or Deletion Time */
-	unsigned int i_block[PINTFS_N_BLOCKS]; /* Direct 0~6, Indirect 7 */
+	unsigned int i_block[PINTFS_N_BLOCKS]; /* Direct 0~5, Indirect 6, Double indirect 7 */
 	unsigned int i_blocks; /* How many blocks this inode uses */
+	unsigned int i_flags; /* PINTFS_*_FL */
 };
 #define PINTFS_INODE_SIZE sizeof(struct pintfs_inode)
+
 /*
-   pintfs_dir_entry - just dir_entry on disk
+   Extent tree - i_block of a PINTFS_EXTENTS_FL inode is the root node.
+   Each node is a header plus entries: pintfs_extent in leaves (depth 0),
+   pintfs_extent_idx in index nodes pointing at child node blocks.
+*/
+#define PINTFS_EXT_MAGIC	0x5045
+#define PINTFS_EXT_MAX_DEPTH	4
+
+struct pintfs_extent_header {
+	unsigned short eh_magic;	/* PINTFS_EXT_MAGIC */
+	unsigned short eh_entries;	/* entries in use */
+	unsigned short eh_max;		/* capacity of this node */
+	unsigned short eh_depth;	/* 0: leaf */
+};
+
+struct pintfs_extent {
+	unsigned int ee_block;	/* first file block */
+	unsigned int ee_start;	/* first disk block */
+	unsigned int ee_len;	/* number of blocks | PINTFS_EXT_UNWRITTEN */
+};
+/* ee_len flag: blocks are allocated but read back as zeros (fallocate) */
+#define PINTFS_EXT_UNWRITTEN	0x80000000U
+
+struct pintfs_extent_idx {
+	unsigned int ei_block;	/* first file block under the child */
+	unsigned int ei_leaf;	/* disk block of the child node */
+	unsigned int ei_unused;
+};
+/*
+   pintfs_dir_entry - just dir_entry on disk (32 bytes, naturally aligned)
 */
 struct pintfs_dir_entry{
-	char name[MAX_NAME_SIZE];
-	int inode_number;
+	unsigned int inode_number;
+	unsigned char name_len;
+	unsigned char file_type;	/* DT_* of the inode, 0: unknown */
+	unsigned char pad[2];
+	char name[MAX_NAME_SIZE];	/* not NUL terminated */
+};
+
+/*
+   pintfs_dir_block - a linear directory block or an index leaf
+   db_tag[i] is a fingerprint of the name hash of db_entry[i], 0 for a
+   free slot. Tags are packed together so a whole block can be filtered
+   a word at a time before any name is compared.
+*/
+#define PINTFS_DIR_TAG_BYTES	128
+#define PINTFS_DIR_SLOTS	((PINTFS_BLOCK_SIZE - PINTFS_DIR_TAG_BYTES) / sizeof(struct pintfs_dir_entry))
+
+struct pintfs_dir_block {
+	unsigned char db_tag[PINTFS_DIR_TAG_BYTES];
+	struct pintfs_dir_entry db_entry[PINTFS_DIR_SLOTS];
 };
 
+
+/*
+   pintfs_dx_root - block 0 of a PINTFS_INDEX_FL directory
+   Extendible hashing: the top dx_depth bits of a name hash pick a slot,
+   the slot names the leaf block holding the entry. A leaf using fewer
+   bits than dx_depth is shared by an aligned run of slots.
+*/
+#define PINTFS_DX_MAGIC		0x50445849
+#define PINTFS_DX_MAX_DEPTH	9
+#define PINTFS_DX_MAX_SLOTS	(1 << PINTFS_DX_MAX_DEPTH)
+
+struct pintfs_dx_root {
+	unsigned int dx_magic;		/* PINTFS_DX_MAGIC */
+	unsigned int dx_depth;		/* hash bits in use, 1 << dx_depth slots */
+	unsigned int dx_slot[PINTFS_DX_MAX_SLOTS];	/* directory block of each slot */
+	unsigned char dx_leaf_depth[PINTFS_DX_MAX_SLOTS];	/* hash bits that leaf uses */
+};
@@ -9,38 +9,15 @@
 #include <linux/iversion.h>
 #include <linux/uidgid.h>
 #include <linux/buffer_head.h>
+#include <linux/bitops.h>
+#include <linux/statfs.h>
+#include <linux/mm.h>
 
 #include "pintfs.h"
 #define DEBUG 1
 
 static struct kmem_cache *pintfs_inode_cache;
 
-int set_bitmap(struct super_block *sb, int bno, int no, int val)
-{
-	struct buffer_head *bh;
-	struct pintfs_super_block *psb = PINTFS_SB(sb)->s_es;
-
-	if (DEBUG)
-		printk("pintfs - set_bitmap\n");
-
-	if(bno == psb->inode_bitmap_block && no >= psb->inodes_count)
-		return -1;
-	else if(bno == psb->block_bitmap_block && no >= psb->blocks_count)
-		return -1;
-
-	bh = sb_bread(sb, bno);
-	if(!bh)
-		return -EINVAL;
-
-	bh->b_data[no] = val;
-	printk("bh->b_data[%d] = %d\n", no, bh->b_data[no]); 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-
-	return 0;
-}
-
 /*
     pintfs_alloc_inode - alloc pintfs_inode_info
 */
@@ -58,6 +35,12 @@ static struct inode *pintfs_alloc_inode(struct super_block *sb)
         return NULL;
     }
 
+    pi->i_flags = 0;
+    pi->i_dir_free = NULL;
+    pi->i_dir_nfree = 0;
+    pi->i_next_lblk = 0;
+    pi->i_next_pblk = 0;
+    pi->i_alloc_reserved = false;
     inode_set_iversion(&pi->vfs_inode, 1);
     if (DEBUG)
         printk("pintfs - alloc ok!\n");
@@ -68,6 +51,7 @@ static void pintfs_free_inode(struct inode *inode)
 {
 	if (DEBUG)
 		printk("pintfs - free inode\n");
+	kfree(PINTFS_I(inode)->i_dir_free);
 	kmem_cache_free(pintfs_inode_cache, PINTFS_I(inode));
 }
 /*
@@ -76,12 +60,23 @@ static void pintfs_free_inode(struct inode *inode)
 static void pintfs_put_super(struct super_block *sb)
 {
 	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
-	struct pintfs_super_block *ps = sbi->s_es;
+	int i;
 
 	if (DEBUG)
 		printk("pintfs - put_super\n");
 
-	kfree(ps);
+	pintfs_release_bitmaps(sb);
+	for(i = 0; i < sbi->s_groups_count; i++)
+		pintfs_release_free_extents(&sbi->s_group_info[i].gi_free);
+	kvfree(sbi->s_group_info);
+	for(i = 0; i < sbi->s_gdb_count; i++)
+		brelse(sbi->s_group_desc[i]);
+	kfree(sbi->s_group_desc);
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+	kfree(sbi->s_blockgroup_lock);
+	brelse(sbi->s_sbh);
 	kfree(sbi);
 	sb->s_fs_info = NULL;
 	if(DEBUG)
@@ -94,11 +89,49 @@ static void pintfs_put_super(struct super_block *sb)
 */
 static int pintfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
+	struct super_block *sb = dentry->d_sb;
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
 	if (DEBUG) 
 		printk("pintfs - statfs\n");
+
+	buf->f_type = PINTFS_MAGIC_NUMBER;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->s_es->blocks_count;
+	// blocks promised to delayed buffers are as good as used
+	buf->f_bfree = max_t(s64, 0, percpu_counter_sum_positive(&sbi->s_freeblocks_counter) -
+			percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter));
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->s_es->inodes_count;
+	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+	buf->f_namelen = MAX_NAME_SIZE;
+	buf->f_fsid = u64_to_fsid(id);
 	return 0;
 }
 
+/*
+	pintfs_sync_fs - write the free counts back to the superblock
+	Group descriptors and bitmaps are block device buffers, the
+	caller writes those out after us.
+*/
+static int pintfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_super_block *es = sbi->s_es;
+
+	if (DEBUG)
+		printk("pintfs - sync_fs wait=%d\n", wait);
+
+	lock_buffer(sbi->s_sbh);
+	es->free_blocks = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+	es->free_inodes = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+	unlock_buffer(sbi->s_sbh);
+	mark_buffer_dirty(sbi->s_sbh);
+	if(wait)
+		sync_dirty_buffer(sbi->s_sbh);
+	return 0;
+}
 
 /*
 	SUPER_OPERATIONS
@@ -106,11 +139,41 @@ static int pintfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 const struct super_operations pintfs_super_ops = {
 	.alloc_inode = pintfs_alloc_inode,
 	.free_inode = pintfs_free_inode,
-//	.evict_inode = pintfs_evict_inode,
+	.dirty_inode = pintfs_dirty_inode,
+	.write_inode = pintfs_write_inode,
+	.evict_inode = pintfs_evict_inode,
 	.put_super = pintfs_put_super,	
+	.sync_fs = pintfs_sync_fs,
 	.statfs = pintfs_statfs,
 };
 
+/*
+	pintfs_check_descriptors - every group keeps its metadata inside itself
+*/
+static int pintfs_check_descriptors(struct super_block *sb)
+{
+	struct pintfs_sb_info *sbi = PINTFS_SB(sb);
+	struct pintfs_group_desc *desc;
+	struct buffer_head *gdbh;
+	unsigned int group, first, last;
+
+	for(group = 0; group < sbi->s_groups_count; group++){
+		desc = pintfs_get_group_desc(sb, group, &gdbh);
+		first = pintfs_group_first_block(sb, group);
+		last = first + pintfs_group_blocks(sb, group) - 1;
+		if(desc->bg_block_bitmap < first || desc->bg_block_bitmap > last ||
+				desc->bg_inode_bitmap < first || desc->bg_inode_bitmap > last ||
+				desc->bg_inode_table < first ||
+				desc->bg_inode_table + sbi->s_itb_per_group - 1 > last ||
+				desc->bg_free_blocks_count > pintfs_group_blocks(sb, group) ||
+				desc->bg_free_inodes_count > sbi->s_inodes_per_group){
+			printk("pintfs - bad descriptor for group %u\n", group);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 /*
 	pintfs_fill_super - Initialize Superblock in main memory
 */
@@ -118,10 +181,13 @@ static int pintfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct pintfs_sb_info *sbi;
 	struct pintfs_super_block *psb;
+	struct pintfs_group_desc *desc;
 	unsigned long sb_block = PINTFS_SUPER_BLOCK;		/* Default location */
 	struct inode *root;
 	long ret = -ENOMEM;
-	struct buffer_head *bh;
+	struct buffer_head *bh, *gdbh;
+	unsigned long free_blocks = 0, free_inodes = 0;
+	int i;
 
 	if (DEBUG)
 		printk("pintfs - fill_super\n");
@@ -129,53 +195,142 @@ static int pintfs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
 	if(!sbi)
 		goto failed;
+	sbi->s_blockgroup_lock = kzalloc(sizeof(struct blockgroup_lock), GFP_KERNEL);
+	if(!sbi->s_blockgroup_lock)
+		goto failed_sbi;
+	bgl_lock_init(sbi->s_blockgroup_lock);
 	
-	// get pintfs_super_block!
+	// page cache and sb_bread both work in pintfs blocks
+	if(!sb_set_blocksize(sb, PINTFS_BLOCK_SIZE))
+		goto failed_sbi;
+
+	// get pintfs_super_block! it stays pinned for sync_fs
 	bh = sb_bread(sb, sb_block);
 	if(!bh)
 		goto failed_sbi;
 
 	sb->s_fs_info = sbi;
 	psb = (struct pintfs_super_block *) (((char *)bh->b_data));
-	sbi->s_es = kzalloc(sizeof(struct pintfs_super_block), GFP_KERNEL);
-	if(!sbi->s_es)
-		goto failed_bh;
-	memcpy(sbi->s_es, psb, sizeof(struct pintfs_super_block));
+	sbi->s_sbh = bh;
+	sbi->s_es = psb;
 	sbi->s_first_ino = PINTFS_GOOD_FIRST_INO;
 	sbi->s_inode_size = PINTFS_INODE_SIZE;
 
+	ret = -EINVAL;
+	if(psb->magic != PINTFS_MAGIC_NUMBER || psb->rev_level != PINTFS_REV){
+		printk("pintfs - bad magic or revision %u (want %u), run mkfs.pintfs\n",
+				psb->rev_level, PINTFS_REV);
+		goto failed_bh;
+	}
+	if(psb->feature_incompat & ~PINTFS_FEATURE_INCOMPAT_SUPP){
+		printk("pintfs - unsupported features 0x%x\n",
+				psb->feature_incompat & ~PINTFS_FEATURE_INCOMPAT_SUPP);
+		goto failed_bh;
+	}
+	if(!psb->blocks_per_group || psb->blocks_per_group > PINTFS_BITS_PER_BLOCK ||
+			!psb->inodes_per_group || psb->inodes_per_group > PINTFS_BITS_PER_BLOCK ||
+			psb->inodes_per_group % PINTFS_INODES_PER_BLOCK ||
+			psb->blocks_count <= psb->first_data_block){
+		printk("pintfs - bad group geometry\n");
+		goto failed_bh;
+	}
+
+	sbi->s_blocks_per_group = psb->blocks_per_group;
+	sbi->s_inodes_per_group = psb->inodes_per_group;
+	sbi->s_itb_per_group = psb->inodes_per_group / PINTFS_INODES_PER_BLOCK;
+	sbi->s_groups_count = DIV_ROUND_UP(psb->blocks_count - psb->first_data_block,
+			psb->blocks_per_group);
+	sbi->s_gdb_count = DIV_ROUND_UP(sbi->s_groups_count, PINTFS_DESC_PER_BLOCK);
+	if((u64)sbi->s_groups_count * sbi->s_inodes_per_group != psb->inodes_count){
+		printk("pintfs - inodes_count does not match the groups\n");
+		goto failed_bh;
+	}
+
+	// Keep the group descriptors in memory for the life of the mount
+	ret = -ENOMEM;
+	sbi->s_group_desc = kcalloc(sbi->s_gdb_count, sizeof(struct buffer_head *), GFP_KERNEL);
+	if(!sbi->s_group_desc)
+		goto failed_bh;
+	ret = -EIO;
+	for(i = 0; i < sbi->s_gdb_count; i++){
+		sbi->s_group_desc[i] = sb_bread(sb, psb->group_desc_block + i);
+		if(!sbi->s_group_desc[i])
+			goto failed_gdt;
+	}
+	ret = -EINVAL;
+	if(!pintfs_check_descriptors(sb))
+		goto failed_gdt;
+
+	// free extent trees are built and bitmaps pinned on first use of each group
+	ret = -ENOMEM;
+	sbi->s_group_info = kvcalloc(sbi->s_groups_count, sizeof(struct pintfs_group_info),
+			GFP_KERNEL);
+	if(!sbi->s_group_info)
+		goto failed_gdt;
+	for(i = 0; i < sbi->s_groups_count; i++)
+		sbi->s_group_info[i].gi_free = RB_ROOT;
+	mutex_init(&sbi->s_group_load_mutex);
+
+	for(i = 0; i < sbi->s_groups_count; i++){
+		desc = pintfs_get_group_desc(sb, i, &gdbh);
+		free_blocks += desc->bg_free_blocks_count;
+		free_inodes += desc->bg_free_inodes_count;
+	}
+	ret = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks, GFP_KERNEL);
+	if(ret)
+		goto failed_group_info;
+	ret = percpu_counter_init(&sbi->s_freeinodes_counter, free_inodes, GFP_KERNEL);
+	if(ret)
+		goto failed_counter;
+	ret = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0, GFP_KERNEL);
+	if(ret){
+		percpu_counter_destroy(&sbi->s_freeinodes_counter);
+		goto failed_counter;
+	}
+
 	sb->s_magic = psb->magic;
 	sb->s_op = &pintfs_super_ops;
+	sb->s_maxbytes = PINTFS_MAX_FILE_SIZE;
 
 	root = pintfs_iget(sb, PINTFS_ROOT_INO);
-	if(!root){
-		ret = -ENOMEM;
-		goto failed_s_es;
+	if(IS_ERR(root)){
+		ret = PTR_ERR(root);
+		goto failed_counters;
 	}
 
-	sb->s_blocksize = PINTFS_BLOCK_SIZE;
 	sb->s_root = d_make_root(root);
 	if(!sb->s_root) {
+		// d_make_root() already dropped root
 		ret = -ENOMEM;
-		goto failed_inode;
+		goto failed_counters;
 	}
 
-	brelse(bh);
 	if(DEBUG){
 		printk("root inode->i_io_list=%p, prev=%p, next=%p\n",
 				&root->i_io_list, root->i_io_list.prev, root->i_io_list.next);
-		printk("pintfs - fill super ok!\n");
+		printk("pintfs - fill super ok! (%u groups)\n", sbi->s_groups_count);
 	}
 	return 0;
 
-failed_inode:
-	iput(root);
-failed_s_es:
-	kfree(sbi->s_es);
+failed_counters:
+	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+failed_counter:
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+failed_group_info:
+	pintfs_release_bitmaps(sb);
+	for(i = 0; i < sbi->s_groups_count; i++)
+		pintfs_release_free_extents(&sbi->s_group_info[i].gi_free);
+	kvfree(sbi->s_group_info);
+failed_gdt:
+	for(i = 0; i < sbi->s_gdb_count; i++)
+		brelse(sbi->s_group_desc[i]);
+	kfree(sbi->s_group_desc);
 failed_bh:
 	brelse(bh);
 failed_sbi:
 	sb->s_fs_info = NULL;
+	kfree(sbi->s_blockgroup_lock);
 	kfree(sbi);
 failed:
 	printk("pintfs - fill super not ok!\n");
@@ -207,6 +362,8 @@ MODULE_ALIAS_FS("pintfs");
 static void init_once(void *foo)
 {
 	struct pintfs_inode_info *pi = (struct pintfs_inode_info *) foo;
+	init_rwsem(&pi->i_map_sem);
+	init_rwsem(&pi->i_mmap_sem);
 	inode_init_once(&pi->vfs_inode);
 }
 